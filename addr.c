@@ -0,0 +1,425 @@
+/* Exact address and domain suffix index
+ *
+ * Full addresses (bob@example.com) go in a hash table and domain
+ * suffixes (*.example.com) in a trie of reversed labels, so a lookup
+ * costs the same no matter how many entries the lists hold. The same
+ * key can appear more than once, for example in both the whitelist
+ * and a folder rule, so lookups report every matching id.
+ *
+ * A blocked Bloom filter can be put in front of the addresses. Each
+ * key sets k bits in one 64 byte block, so a miss costs one cache
+ * line rather than a probe of the much larger table.
+ */
+#include "rtf.h"
+
+struct slot {
+	const char *key;
+	unsigned len;
+	unsigned id;
+};
+
+/* An edge from parent to child labelled with one domain label */
+struct edge {
+	const char *label;
+	unsigned len;
+	unsigned parent;
+	unsigned child;
+};
+
+struct out {
+	unsigned id;
+	unsigned next; /* 0 for end */
+};
+
+#define BLOOM_BLOCK_BITS	512
+#define BLOOM_BLOCK_WORDS	(BLOOM_BLOCK_BITS / 64)
+
+struct addr_index {
+	struct slot *slots;
+	unsigned n_slots, slot_mask;
+
+	uint64_t *bloom; /* NULL for none */
+	unsigned n_blocks;
+	int k;
+
+	struct edge *edges;
+	unsigned n_edges, edge_mask;
+
+	/* node 0 is the root, out[0] is unused */
+	unsigned *node_out;
+	unsigned n_nodes, max_nodes;
+	struct out *outs;
+	unsigned n_outs, max_outs;
+};
+
+static inline uint32_t hash_str(uint32_t hash, const char *str, unsigned len)
+{	/* case insensitive FNV-1a */
+	for (unsigned i = 0; i < len; ++i) {
+		hash ^= tolower((unsigned char)str[i]);
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+#define HASH_INIT 2166136261u
+
+static int valid_local(int c)
+{
+	return isalnum(c) || (c && strchr(".!#$%&'*+/=?^_`{|}~-", c));
+}
+
+static int valid_domain(int c)
+{
+	return isalnum(c) || c == '.' || c == '-';
+}
+
+/* Returns ADDR_EXACT, ADDR_DOMAIN, or ADDR_NONE for entries that must
+ * be matched as a substring.
+ */
+int addr_kind(const char *str)
+{
+	const char *p;
+
+	if (strncmp(str, "*.", 2) == 0) {
+		for (p = str + 2; *p; ++p)
+			if (!valid_domain(*p))
+				return ADDR_NONE;
+		return p > str + 2 && p[-1] != '.' ? ADDR_DOMAIN : ADDR_NONE;
+	}
+
+	for (p = str; valid_local(*p); ++p) ;
+	if (p == str || *p != '@' || p[-1] == '.')
+		return ADDR_NONE;
+	const char *domain = ++p;
+	for (; *p; ++p)
+		if (!valid_domain(*p))
+			return ADDR_NONE;
+	if (p == domain || *domain == '.' || p[-1] == '.')
+		return ADDR_NONE;
+	return ADDR_EXACT;
+}
+
+struct addr_index *addr_index_new(void)
+{
+	struct addr_index *ix = calloc(1, sizeof(struct addr_index));
+	if (!ix)
+		return NULL;
+
+	ix->n_nodes = 1; /* root */
+	ix->n_outs = 1;
+	return ix;
+}
+
+void addr_index_free(struct addr_index *ix)
+{
+	if (ix) {
+		free(ix->slots);
+		free(ix->bloom);
+		free(ix->edges);
+		free(ix->node_out);
+		free(ix->outs);
+		free(ix);
+	}
+}
+
+static int grow_slots(struct addr_index *ix)
+{
+	unsigned size = ix->slot_mask ? (ix->slot_mask + 1) * 2 : 64;
+	struct slot *slots = calloc(size, sizeof(struct slot));
+	if (!slots)
+		return -1;
+
+	for (unsigned i = 0; ix->slot_mask && i <= ix->slot_mask; ++i) {
+		struct slot *s = &ix->slots[i];
+		if (!s->key)
+			continue;
+		unsigned h = hash_str(HASH_INIT, s->key, s->len) & (size - 1);
+		while (slots[h].key)
+			h = (h + 1) & (size - 1);
+		slots[h] = *s;
+	}
+
+	free(ix->slots);
+	ix->slots = slots;
+	ix->slot_mask = size - 1;
+	return 0;
+}
+
+static int add_exact(struct addr_index *ix, const char *str, unsigned id)
+{
+	if (ix->n_slots * 2 >= ix->slot_mask)
+		if (grow_slots(ix))
+			return -1;
+
+	unsigned len = strlen(str);
+	unsigned h = hash_str(HASH_INIT, str, len) & ix->slot_mask;
+	while (ix->slots[h].key)
+		h = (h + 1) & ix->slot_mask;
+
+	ix->slots[h].key = str;
+	ix->slots[h].len = len;
+	ix->slots[h].id = id;
+	++ix->n_slots;
+	return 0;
+}
+
+static inline uint32_t hash_edge(unsigned parent, const char *label, unsigned len)
+{
+	return hash_str(HASH_INIT ^ (parent * 2654435761u), label, len);
+}
+
+static int grow_edges(struct addr_index *ix)
+{
+	unsigned size = ix->edge_mask ? (ix->edge_mask + 1) * 2 : 64;
+	struct edge *edges = calloc(size, sizeof(struct edge));
+	if (!edges)
+		return -1;
+
+	for (unsigned i = 0; ix->edge_mask && i <= ix->edge_mask; ++i) {
+		struct edge *e = &ix->edges[i];
+		if (!e->label)
+			continue;
+		unsigned h = hash_edge(e->parent, e->label, e->len) & (size - 1);
+		while (edges[h].label)
+			h = (h + 1) & (size - 1);
+		edges[h] = *e;
+	}
+
+	free(ix->edges);
+	ix->edges = edges;
+	ix->edge_mask = size - 1;
+	return 0;
+}
+
+static unsigned find_edge(const struct addr_index *ix, unsigned parent,
+						  const char *label, unsigned len)
+{
+	if (!ix->edges)
+		return 0;
+
+	unsigned h = hash_edge(parent, label, len) & ix->edge_mask;
+	for (; ix->edges[h].label; h = (h + 1) & ix->edge_mask) {
+		const struct edge *e = &ix->edges[h];
+		if (e->parent == parent && e->len == len &&
+			strncasecmp(e->label, label, len) == 0)
+			return e->child;
+	}
+
+	return 0;
+}
+
+/* Returns the child node, adding it if needed, or 0 on error */
+static unsigned add_edge(struct addr_index *ix, unsigned parent,
+						 const char *label, unsigned len)
+{
+	unsigned child = find_edge(ix, parent, label, len);
+	if (child)
+		return child;
+
+	if (ix->n_edges * 2 >= ix->edge_mask)
+		if (grow_edges(ix))
+			return 0;
+
+	if (ix->n_nodes >= ix->max_nodes) {
+		unsigned max = ix->max_nodes ? ix->max_nodes * 2 : 64;
+		unsigned *node_out = realloc(ix->node_out, max * sizeof(unsigned));
+		if (!node_out)
+			return 0;
+		ix->node_out = node_out;
+		ix->max_nodes = max;
+		if (ix->n_nodes == 1)
+			ix->node_out[0] = 0;
+	}
+
+	child = ix->n_nodes++;
+	ix->node_out[child] = 0;
+
+	unsigned h = hash_edge(parent, label, len) & ix->edge_mask;
+	while (ix->edges[h].label)
+		h = (h + 1) & ix->edge_mask;
+	ix->edges[h].label = label;
+	ix->edges[h].len = len;
+	ix->edges[h].parent = parent;
+	ix->edges[h].child = child;
+	++ix->n_edges;
+
+	return child;
+}
+
+static int add_domain(struct addr_index *ix, const char *domain, unsigned id)
+{
+	unsigned node = 0;
+	const char *end = domain + strlen(domain);
+
+	/* walk the labels right to left */
+	while (end > domain) {
+		const char *label = end;
+		while (label > domain && label[-1] != '.')
+			--label;
+
+		if (!(node = add_edge(ix, node, label, end - label)))
+			return -1;
+
+		end = label > domain ? label - 1 : label;
+	}
+
+	if (ix->n_outs >= ix->max_outs) {
+		unsigned max = ix->max_outs ? ix->max_outs * 2 : 64;
+		struct out *outs = realloc(ix->outs, max * sizeof(struct out));
+		if (!outs)
+			return -1;
+		ix->outs = outs;
+		ix->max_outs = max;
+	}
+
+	ix->outs[ix->n_outs].id = id;
+	ix->outs[ix->n_outs].next = ix->node_out[node];
+	ix->node_out[node] = ix->n_outs++;
+	return 0;
+}
+
+/* str must stay valid for the life of the index */
+int addr_index_add(struct addr_index *ix, const char *str, unsigned id)
+{
+	switch (addr_kind(str)) {
+	case ADDR_EXACT:
+		return add_exact(ix, str, id);
+	case ADDR_DOMAIN:
+		return add_domain(ix, str + 2, id);
+	default:
+		return -1;
+	}
+}
+
+static inline uint64_t hash_bloom(const char *str, unsigned len)
+{	/* case insensitive FNV-1a 64 with a final mix */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (unsigned i = 0; i < len; ++i) {
+		hash ^= tolower((unsigned char)str[i]);
+		hash *= 0x100000001b3ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static inline uint64_t *bloom_block(const struct addr_index *ix, uint64_t hash)
+{
+	return ix->bloom + ((hash >> 32) * ix->n_blocks >> 32) * BLOOM_BLOCK_WORDS;
+}
+
+static void bloom_set(struct addr_index *ix, const char *str, unsigned len)
+{
+	uint64_t hash = hash_bloom(str, len);
+	uint64_t *block = bloom_block(ix, hash);
+	uint32_t h1 = hash, h2 = (hash >> 17) | 1;
+
+	for (int i = 0; i < ix->k; ++i, h1 += h2) {
+		unsigned bit = h1 & (BLOOM_BLOCK_BITS - 1);
+		block[bit / 64] |= 1ULL << (bit & 63);
+	}
+}
+
+static int bloom_test(const struct addr_index *ix, const char *str, unsigned len)
+{
+	uint64_t hash = hash_bloom(str, len);
+	const uint64_t *block = bloom_block(ix, hash);
+	uint32_t h1 = hash, h2 = (hash >> 17) | 1;
+
+	for (int i = 0; i < ix->k; ++i, h1 += h2) {
+		unsigned bit = h1 & (BLOOM_BLOCK_BITS - 1);
+		if (!(block[bit / 64] & (1ULL << (bit & 63))))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Puts a Bloom filter with a false positive rate of about fp in front
+ * of the addresses. Call after all the addresses are added. An fp of
+ * 0 removes the filter.
+ */
+int addr_index_bloom(struct addr_index *ix, double fp)
+{
+	free(ix->bloom);
+	ix->bloom = NULL;
+
+	if (fp <= 0 || fp >= 1 || ix->n_slots == 0)
+		return 0;
+
+	/* k = -log2(fp) and m/n = k / ln 2 is optimal */
+	int k = 0;
+	for (double p = 1; p > fp && k < 16; p /= 2)
+		++k;
+	uint64_t bits = (uint64_t)ix->n_slots * k * 1443 / 1000;
+	ix->n_blocks = (bits + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+	ix->k = k;
+
+	/* aligned so a block is one cache line */
+	if (posix_memalign((void **)&ix->bloom, 64, ix->n_blocks * 64)) {
+		ix->bloom = NULL;
+		return -1;
+	}
+	memset(ix->bloom, 0, ix->n_blocks * 64);
+
+	for (unsigned i = 0; i <= ix->slot_mask; ++i)
+		if (ix->slots[i].key)
+			bloom_set(ix, ix->slots[i].key, ix->slots[i].len);
+
+	return 0;
+}
+
+static void lookup(const struct addr_index *ix, const char *addr, unsigned len,
+				   const char *domain, match_fn hit, void *arg)
+{
+	if (ix->slots && (!ix->bloom || bloom_test(ix, addr, len))) {
+		unsigned h = hash_str(HASH_INIT, addr, len) & ix->slot_mask;
+		for (; ix->slots[h].key; h = (h + 1) & ix->slot_mask) {
+			const struct slot *s = &ix->slots[h];
+			if (s->len == len && strncasecmp(s->key, addr, len) == 0)
+				hit(s->id, arg);
+		}
+	}
+
+	unsigned node = 0;
+	const char *end = addr + len;
+
+	while (end > domain) {
+		const char *label = end;
+		while (label > domain && label[-1] != '.')
+			--label;
+
+		if (!(node = find_edge(ix, node, label, end - label)))
+			return;
+		for (unsigned o = ix->node_out[node]; o; o = ix->outs[o].next)
+			hit(ix->outs[o].id, arg);
+
+		end = label > domain ? label - 1 : label;
+	}
+}
+
+/* Calls hit() for every entry that matches an address in the header
+ * line. The addresses are found by looking for an @ and expanding
+ * out, so names, comments, and angle brackets are ignored.
+ */
+void addr_scan(const struct addr_index *ix, const char *line, match_fn hit, void *arg)
+{
+	const char *at;
+
+	while ((at = strchr(line, '@'))) {
+		const char *start = at, *end = at + 1;
+
+		while (start > line && valid_local((unsigned char)start[-1]))
+			--start;
+		while (valid_domain((unsigned char)*end))
+			++end;
+		while (end > at + 1 && end[-1] == '.')
+			--end;
+
+		if (start < at && end > at + 1)
+			lookup(ix, start, end - start, at + 1, hit, arg);
+
+		line = at + 1;
+	}
+}
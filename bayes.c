@@ -0,0 +1,541 @@
+/* Built in Bayesian classifier
+ *
+ * A small bogofilter work-alike so rtf does not have to run a shell
+ * and bogofilter twice for every message. The tokens are counted in
+ * ~/.rtf.bayes, an open addressing hash table of token hashes that is
+ * mapped shared. Scoring is Robinson's f(w) combined with Fisher's
+ * chi-square, with the bogofilter defaults.
+ *
+ * The tokens of a message are gathered once by bayes_classify() and
+ * reused by bayes_register().
+ *
+ * Import your bogofilter training with:
+ *     bogoutil -d ~/.bogofilter/wordlist.db | rtf -I -
+ *
+ * Once the db exists learnem -b trains it instead of bogofilter.
+ */
+#include "rtf.h"
+#include <math.h>
+#include <sys/mman.h>
+
+#define BAYES_MAGIC		0x42465452 /* RTFB */
+#define BAYES_SLOTS		(1 << 20)  /* initial size */
+
+#define MIN_TOKEN_LEN	3
+#define MAX_TOKEN_LEN	30
+
+/* bogofilter defaults */
+#define ROBS			0.0178
+#define ROBX			0.52
+#define MIN_DEV			0.375
+#define SPAM_CUTOFF		0.99
+
+struct bayes_slot {
+	uint64_t hash; /* 0 for empty */
+	uint32_t spam;
+	uint32_t ham;
+};
+
+struct bayes_db {
+	uint32_t magic;
+	uint32_t n_slots;
+	uint32_t n_used;
+	uint32_t spam_msgs;
+	uint32_t ham_msgs;
+	uint32_t pad;
+	struct bayes_slot slots[];
+};
+
+static char db_path[256];
+static int db_fd = -1;
+static ino_t db_ino;
+static struct bayes_db *db;
+static size_t db_size;
+
+/* The unique tokens of the current message */
+static uint64_t *tokens;
+static unsigned n_tokens, max_tokens;
+static char tokens_fname[256];
+
+static size_t db_bytes(uint32_t n_slots)
+{
+	return sizeof(struct bayes_db) + (size_t)n_slots * sizeof(struct bayes_slot);
+}
+
+static void db_close(void)
+{
+	if (db)
+		munmap(db, db_size);
+	if (db_fd >= 0)
+		close(db_fd);
+	db = NULL;
+	db_fd = -1;
+}
+
+static int db_map(int fd)
+{
+	struct stat sbuf;
+
+	if (fstat(fd, &sbuf) || sbuf.st_size < sizeof(struct bayes_db))
+		return -1;
+
+	void *map = mmap(NULL, sbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	struct bayes_db *new = map;
+	if (new->magic != BAYES_MAGIC || db_bytes(new->n_slots) > sbuf.st_size) {
+		munmap(map, sbuf.st_size);
+		return -1;
+	}
+
+	db_close();
+	db = new;
+	db_size = sbuf.st_size;
+	db_fd = fd;
+	db_ino = sbuf.st_ino;
+	return 0;
+}
+
+/* Remap if the db was replaced when it grew */
+static int db_check(void)
+{
+	struct stat sbuf;
+
+	if (db && stat(db_path, &sbuf) == 0 && sbuf.st_ino == db_ino)
+		return 0;
+
+	int fd = open(db_path, O_RDWR);
+	if (fd < 0)
+		return -1;
+	if (db_map(fd)) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns 0 if there is a token db */
+int bayes_open(const char *dir)
+{
+	snprintf(db_path, sizeof(db_path), "%s/.rtf.bayes", dir);
+	return db_check();
+}
+
+static struct bayes_slot *db_find(struct bayes_db *d, uint64_t hash, int add)
+{
+	uint32_t mask = d->n_slots - 1;
+
+	for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+		struct bayes_slot *s = &d->slots[i];
+		if (s->hash == hash)
+			return s;
+		if (s->hash == 0) {
+			if (!add)
+				return NULL;
+			s->hash = hash;
+			++d->n_used;
+			return s;
+		}
+	}
+}
+
+/* Creates a db with n_slots and copies the old one into it. Must be
+ * called with the lock held. The new db replaces the old one with a
+ * rename, so anybody waiting on the old lock must call db_check().
+ */
+static int db_create(uint32_t n_slots)
+{
+	char tmp[300];
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", db_path, getpid());
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		goto failed;
+	if (ftruncate(fd, db_bytes(n_slots)))
+		goto failed;
+
+	struct bayes_db *new = mmap(NULL, db_bytes(n_slots), PROT_READ | PROT_WRITE,
+								MAP_SHARED, fd, 0);
+	if (new == MAP_FAILED)
+		goto failed;
+
+	new->magic = BAYES_MAGIC;
+	new->n_slots = n_slots;
+	if (db) {
+		new->spam_msgs = db->spam_msgs;
+		new->ham_msgs = db->ham_msgs;
+		for (uint32_t i = 0; i < db->n_slots; ++i)
+			if (db->slots[i].hash) {
+				struct bayes_slot *s = db_find(new, db->slots[i].hash, 1);
+				s->spam = db->slots[i].spam;
+				s->ham = db->slots[i].ham;
+			}
+	}
+	munmap(new, db_bytes(n_slots));
+
+	/* Take the lock on the new db before anybody can see it */
+	if (flock(fd, LOCK_EX) || rename(tmp, db_path) || db_map(fd))
+		goto failed;
+
+	return 0;
+
+failed:
+	syslog(LOG_ERR, "%s: %m", tmp);
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+/* Lock the current db, creating it if needed */
+static int db_lock(void)
+{
+	while (1) {
+		if (db_check())
+			/* db_create returns with the lock held */
+			return errno == ENOENT ? db_create(BAYES_SLOTS) : -1;
+
+		if (flock(db_fd, LOCK_EX))
+			return -1;
+
+		struct stat sbuf;
+		if (stat(db_path, &sbuf) == 0 && sbuf.st_ino == db_ino)
+			return 0;
+		/* it grew while we waited */
+		flock(db_fd, LOCK_UN);
+	}
+}
+
+static void db_unlock(void)
+{
+	flock(db_fd, LOCK_UN);
+}
+
+/* Keep the table at most 3/4 full. Lock must be held. */
+static int db_reserve(unsigned n)
+{
+	uint32_t n_slots = db->n_slots;
+
+	while ((uint64_t)(db->n_used + n) * 4 > (uint64_t)n_slots * 3)
+		n_slots *= 2;
+
+	return n_slots == db->n_slots ? 0 : db_create(n_slots);
+}
+
+static void add_token(uint64_t hash)
+{
+	if (hash == 0)
+		hash = 1;
+
+	if (n_tokens * 2 >= max_tokens) {
+		unsigned max = max_tokens ? max_tokens * 2 : 4096;
+		uint64_t *new = calloc(max, sizeof(uint64_t));
+		if (!new)
+			return; /* just ignore the token */
+		for (unsigned i = 0; i < max_tokens; ++i)
+			if (tokens[i]) {
+				unsigned j = tokens[i] & (max - 1);
+				while (new[j])
+					j = (j + 1) & (max - 1);
+				new[j] = tokens[i];
+			}
+		free(tokens);
+		tokens = new;
+		max_tokens = max;
+	}
+
+	unsigned i = hash & (max_tokens - 1);
+	while (tokens[i]) {
+		if (tokens[i] == hash)
+			return;
+		i = (i + 1) & (max_tokens - 1);
+	}
+	tokens[i] = hash;
+	++n_tokens;
+}
+
+static uint64_t hash_token(const char *tag, const char *str, int len)
+{	/* FNV-1a 64 of tag and token */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (; *tag; ++tag)
+		hash = (hash ^ (uint8_t)*tag) * 0x100000001b3ULL;
+	for (int i = 0; i < len; ++i)
+		hash = (hash ^ (uint8_t)str[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+static inline int token_char(int c)
+{
+	return isalnum(c) || c == '$' || c == '\'' || c == '_' || c == '-' ||
+		c == '.' || (c & 0x80);
+}
+
+/* Tokens are runs of token chars with the punctuation trimmed off the
+ * ends. Too short, too long, and all digit tokens are ignored.
+ */
+static void tokenize(const char *tag, const char *p, const char *end)
+{
+	while (p < end) {
+		while (p < end && !token_char((unsigned char)*p))
+			++p;
+		const char *start = p;
+		while (p < end && token_char((unsigned char)*p))
+			++p;
+
+		const char *e = p;
+		while (start < e && !isalnum((unsigned char)*start) && !(*start & 0x80))
+			++start;
+		while (e > start && (e[-1] == '.' || e[-1] == '-' || e[-1] == '\''))
+			--e;
+
+		int len = e - start, digits = 1;
+		if (len < MIN_TOKEN_LEN || len > MAX_TOKEN_LEN)
+			continue;
+		for (const char *s = start; s < e && digits; ++s)
+			digits = isdigit((unsigned char)*s);
+		if (!digits)
+			add_token(hash_token(tag, start, len));
+	}
+}
+
+/* Header tokens are tagged by field like bogofilter does */
+static const char *header_tag(const char *line, const char *end)
+{
+	static const struct {
+		const char *name;
+		int len;
+		const char *tag;
+	} tags[] = {
+		{ "Subject:", 8, "subj:" },
+		{ "From:", 5, "from:" },
+		{ "To:", 3, "to:" },
+		{ "Received:", 9, "rcvd:" },
+	};
+
+	for (int i = 0; i < sizeof(tags) / sizeof(tags[0]); ++i)
+		if (end - line >= tags[i].len && strncasecmp(line, tags[i].name, tags[i].len) == 0)
+			return tags[i].tag;
+	return "head:";
+}
+
+static int gather_tokens(const char *fname)
+{
+	n_tokens = 0;
+	if (tokens)
+		memset(tokens, 0, max_tokens * sizeof(uint64_t));
+	snprintf(tokens_fname, sizeof(tokens_fname), "%s", fname);
+
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat sbuf;
+	if (fstat(fd, &sbuf) || sbuf.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	const char *msg = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (msg == MAP_FAILED)
+		return -1;
+
+	const char *p = msg, *end = msg + sbuf.st_size;
+	const char *tag = "head:";
+	int in_header = 1;
+
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		if (in_header) {
+			if (p == eol || (*p == '\r' && p + 1 == eol))
+				in_header = 0;
+			else {
+				if (*p != ' ' && *p != '\t') {
+					tag = header_tag(p, eol);
+					/* skip the field name */
+					const char *colon = memchr(p, ':', eol - p);
+					if (colon)
+						p = colon + 1;
+				}
+				tokenize(tag, p, eol);
+			}
+		} else
+			tokenize("", p, eol);
+
+		p = eol + 1;
+	}
+
+	munmap((void *)msg, sbuf.st_size);
+	return 0;
+}
+
+/* Upper tail of the chi-square distribution for even df */
+static double chi2q(double x2, int df)
+{
+	double m = x2 / 2.0, sum, term;
+
+	sum = term = exp(-m);
+	for (int i = 1; i < df / 2; ++i) {
+		term *= m / i;
+		sum += term;
+	}
+	return sum < 1.0 ? sum : 1.0;
+}
+
+/* Returns the spamicity of the tokens */
+static double score(void)
+{
+	double ln_ham = 0, ln_spam = 0;
+	int n = 0;
+	uint32_t nspam = db->spam_msgs ? db->spam_msgs : 1;
+	uint32_t nham = db->ham_msgs ? db->ham_msgs : 1;
+
+	for (unsigned i = 0; i < max_tokens; ++i) {
+		if (!tokens[i])
+			continue;
+
+		struct bayes_slot *s = db_find(db, tokens[i], 0);
+		double bad = s ? s->spam : 0, good = s ? s->ham : 0;
+		double fw = ROBX;
+
+		if (bad + good > 0) {
+			double pbad = bad / nspam, pgood = good / nham;
+			double pw = pbad / (pbad + pgood);
+			fw = (ROBS * ROBX + (bad + good) * pw) / (ROBS + bad + good);
+		}
+
+		if (fabs(fw - 0.5) < MIN_DEV)
+			continue;
+
+		ln_ham += log(fw);
+		ln_spam += log(1.0 - fw);
+		++n;
+	}
+
+	if (n == 0)
+		return ROBX;
+
+	double h = chi2q(-2.0 * ln_ham, 2 * n);
+	double s = chi2q(-2.0 * ln_spam, 2 * n);
+	return (1.0 + h - s) / 2.0;
+}
+
+/* Returns 0 for spam and 1 for ham, like bogofilter */
+int bayes_classify(const char *fname)
+{
+	if (gather_tokens(fname) || db_check())
+		return 1;
+
+	return score() >= SPAM_CUTOFF ? 0 : 1;
+}
+
+/* Add the message to the spam or ham counts */
+int bayes_register(const char *fname, int is_spam)
+{
+	if (strcmp(fname, tokens_fname) && gather_tokens(fname))
+		return -1;
+
+	if (db_lock())
+		return -1;
+
+	if (db_reserve(n_tokens) == 0) {
+		for (unsigned i = 0; i < max_tokens; ++i)
+			if (tokens[i]) {
+				struct bayes_slot *s = db_find(db, tokens[i], 1);
+				if (is_spam)
+					++s->spam;
+				else
+					++s->ham;
+			}
+
+		if (is_spam)
+			++db->spam_msgs;
+		else
+			++db->ham_msgs;
+	}
+
+	db_unlock();
+	return 0;
+}
+
+/* Take the message back out of the spam or ham counts, for when rtf
+ * registered it as the wrong one.
+ */
+int bayes_unregister(const char *fname, int is_spam)
+{
+	if (strcmp(fname, tokens_fname) && gather_tokens(fname))
+		return -1;
+
+	if (db_lock())
+		return -1;
+
+	for (unsigned i = 0; i < max_tokens; ++i)
+		if (tokens[i]) {
+			struct bayes_slot *s = db_find(db, tokens[i], 0);
+			if (!s)
+				continue;
+			if (is_spam && s->spam)
+				--s->spam;
+			else if (!is_spam && s->ham)
+				--s->ham;
+		}
+
+	if (is_spam && db->spam_msgs)
+		--db->spam_msgs;
+	else if (!is_spam && db->ham_msgs)
+		--db->ham_msgs;
+
+	db_unlock();
+	return 0;
+}
+
+/* Import the output of bogoutil -d: token spam ham [date] lines. The
+ * .MSG_COUNT token holds the message counts.
+ */
+int bayes_import(const char *dir, FILE *fp)
+{
+	char line[512];
+	unsigned n = 0;
+
+	snprintf(db_path, sizeof(db_path), "%s/.rtf.bayes", dir);
+	if (db_lock()) {
+		perror(db_path);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *token = strtok(line, " \t\r\n");
+		char *spam = strtok(NULL, " \t\r\n");
+		char *ham = strtok(NULL, " \t\r\n");
+		if (!token || !spam || !ham)
+			continue;
+
+		if (strcmp(token, ".MSG_COUNT") == 0) {
+			db->spam_msgs += strtoul(spam, NULL, 10);
+			db->ham_msgs += strtoul(ham, NULL, 10);
+			continue;
+		}
+		if (*token == '.')
+			continue; /* other bogofilter specials */
+
+		if (db_reserve(1))
+			break;
+
+		/* tokens from the header carry their tag */
+		uint64_t hash = hash_token("", token, strlen(token));
+		struct bayes_slot *s = db_find(db, hash ? hash : 1, 1);
+		s->spam += strtoul(spam, NULL, 10);
+		s->ham += strtoul(ham, NULL, 10);
+		++n;
+	}
+
+	printf("Imported %u tokens, %u spam and %u ham messages\n",
+		   n, db->spam_msgs, db->ham_msgs);
+	db_unlock();
+	return 0;
+}
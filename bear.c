@@ -97,6 +97,19 @@ int ssl_timed_read(char *buffer, int len, int timeout)
 		}
 }
 
+/* Queue data to go out on the next flush. BearSSL will send full
+ * records on its own.
+ */
+int ssl_queue(const char *buffer, int len)
+{
+	return br_sslio_write_all(&ioc, buffer, len) == 0 ? len : -1;
+}
+
+int ssl_flush(void)
+{
+	return br_sslio_flush(&ioc);
+}
+
 int ssl_write(const char *buffer, int len)
 {
 	int rc = br_sslio_write_all(&ioc, buffer, len);
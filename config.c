@@ -16,6 +16,60 @@ int use_stderr;
 const char *diary;
 static int generation;
 
+static struct entry **const match_lists[N_LISTS] = {
+	&whitelist, &graylist, &blacklist, &folderlist
+};
+
+/* The config section names, used to name the rules in the stats */
+static const char *const list_names[N_LISTS] = {
+	"whitelist", "graylist", "blacklist", "folders"
+};
+static struct rule_stats *scan_stats;
+static unsigned new_hits;
+
+#define LIST(n) (1 << (n))
+
+/* Which lists each field is checked against and the prefix used to
+ * limit an entry to the field.
+ */
+static const struct field {
+	const char *scope;
+	unsigned lists;
+	int addresses;	/* the field holds addresses */
+} fields[N_FIELDS] = {
+	[FIELD_TO] = { "to:", LIST(WHITELIST) | LIST(FOLDERLIST), 1 },
+	[FIELD_FROM] = { "from:",
+					 LIST(WHITELIST) | LIST(GRAYLIST) | LIST(BLACKLIST) | LIST(FOLDERLIST), 1 },
+	[FIELD_SUBJECT] = { "subject:", LIST(BLACKLIST) | LIST(FOLDERLIST), 0 },
+	[FIELD_LIST] = { "list:", LIST(FOLDERLIST), 1 },
+	[FIELD_REPLY_TO] = { "reply-to:", LIST(FOLDERLIST), 1 },
+	[FIELD_RETURN_PATH] = { "return-path:",
+							LIST(WHITELIST) | LIST(GRAYLIST) | LIST(BLACKLIST), 1 },
+};
+
+/* One matcher per field */
+static struct matcher *matchers[N_FIELDS];
+static struct entry **match_entries;
+/* New hits by entry index since they were last added to the entries */
+static unsigned *entry_hits;
+static unsigned n_entries;
+/* Addresses and domains are looked up rather than matched */
+static struct addr_index *addr_index;
+
+/* Plain blacklist addresses and domains are only kept as strings so
+ * that large imported feeds do not need an entry each. They all share
+ * the bulk entry, which comes after the real blacklist entries.
+ */
+static struct entry bulk_entry = {
+	.str = "[bulk]", .match = "[bulk]", .addr = ADDR_EXACT, .list = BLACKLIST
+};
+static char *bulk;
+static size_t bulk_len, bulk_size;
+static unsigned n_bulk;
+
+/* The fields some entry can match */
+static unsigned field_mask;
+
 static inline int write_string(char *str)
 {
 	strcat(str, "\n");
@@ -53,13 +107,70 @@ int get_global_num(const char *glob)
 	return 0;
 }
 
+static int is_match_list(struct entry **head)
+{
+	for (int i = 0; i < N_LISTS; ++i)
+		if (head == match_lists[i])
+			return 1;
+	return 0;
+}
+
+/* Strip a field scope such as from: off the match string */
+static void set_scope(struct entry *e)
+{
+	e->match = e->str;
+	e->fields = 0;
+
+	for (int i = 0; i < N_FIELDS; ++i) {
+		int len = strlen(fields[i].scope);
+		if (strncmp(e->str, fields[i].scope, len) == 0) {
+			e->match = e->str + len;
+			e->fields = 1 << i;
+			return;
+		}
+	}
+}
+
+static int has_scope(const char *str)
+{
+	for (int i = 0; i < N_FIELDS; ++i)
+		if (strncmp(str, fields[i].scope, strlen(fields[i].scope)) == 0)
+			return 1;
+	return 0;
+}
+
+static void add_bulk(const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	if (bulk_len + len > bulk_size) {
+		size_t size = bulk_size ? bulk_size * 2 : 64 * 1024;
+		while (size < bulk_len + len)
+			size *= 2;
+		char *new = realloc(bulk, size);
+		if (!new) {
+			logmsg(LOG_ERR, "Out of memory.");
+			exit(1);
+		}
+		bulk = new;
+		bulk_size = size;
+	}
+
+	memcpy(bulk + bulk_len, str, len);
+	bulk_len += len;
+	++n_bulk;
+}
+
 int add_entry(struct entry **head, char *str)
 {
 	char *p = NULL;
-	int need_p = 0;
+	int need_p = 0, escaped = 0;
 	struct entry *tail = NULL;
 
-	if (*str == '\\') ++str;
+	if (*str == '\\') {
+		++str;
+		escaped = 1;
+	}
 
 	if (head == &global || head == &folderlist) {
 		p = strchr(str, '=');
@@ -79,6 +190,12 @@ int add_entry(struct entry **head, char *str)
 		}
 	}
 
+	if (head == &blacklist && !escaped && !has_scope(str) &&
+		addr_kind(str) != ADDR_NONE) {
+		add_bulk(str);
+		return 0;
+	}
+
 	for (struct entry *e = *head; e; e = e->next) {
 		if (strcmp(e->str, str) == 0) {
 			if (p && strcmp(e->folder, p)) {
@@ -102,6 +219,12 @@ int add_entry(struct entry **head, char *str)
 		if (!(new->folder = strdup(p)))
 			goto oom;
 
+	if (is_match_list(head) && !escaped) {
+		set_scope(new);
+		new->addr = addr_kind(new->match);
+	} else
+		new->match = new->str;
+
 	new->generation = generation;
 	if (tail) {
 		new->prev = tail;
@@ -151,6 +274,385 @@ static struct entry *check_global(const char *glob)
 	return NULL;
 }
 
+static inline int in_field(const struct entry *e, int field)
+{
+	return (fields[field].lists & LIST(e->list)) &&
+		(e->fields == 0 || (e->fields & (1 << field)));
+}
+
+static inline int indexed(const struct entry *e)
+{
+	return e->addr != ADDR_NONE && addr_index;
+}
+
+/* Index the address entries and the bulk entries. The bulk entries
+ * all have the id n.
+ */
+static struct addr_index *index_addresses(unsigned n)
+{
+	struct addr_index *ix = addr_index_new();
+	const char *fp = get_global("bloom_fp");
+	const char *s = bulk;
+	unsigned id;
+
+	if (!ix)
+		return NULL;
+
+	for (id = 0; id < n; ++id)
+		if (match_entries[id]->addr != ADDR_NONE)
+			if (addr_index_add(ix, match_entries[id]->match, id))
+				goto failed;
+
+	for (unsigned i = 0; i < n_bulk; ++i, s += strlen(s) + 1)
+		if (addr_index_add(ix, s, n))
+			goto failed;
+
+	if (addr_index_bloom(ix, fp ? strtod(fp, NULL) : 0.01))
+		goto failed;
+
+	return ix;
+
+failed:
+	addr_index_free(ix);
+	return NULL;
+}
+
+/* Compile the match lists into one matcher per field. Each matcher
+ * only gets the entries that can match that field. If this fails,
+ * match_line() falls back to walking the lists.
+ */
+static void compile_lists(void)
+{
+	unsigned n = 0, id;
+	struct entry *e;
+	int i, f;
+
+	for (f = 0; f < N_FIELDS; ++f) {
+		matcher_free(matchers[f]);
+		matchers[f] = NULL;
+	}
+	free(match_entries);
+	match_entries = NULL;
+	n_entries = 0;
+
+	stats_open(home);
+	scan_stats = stats_rule("imap-rtf", "matcher");
+
+	for (i = 0; i < N_LISTS; ++i) {
+		unsigned rank = 0;
+		for (e = *match_lists[i]; e; e = e->next) {
+			e->list = i;
+			e->index = n++;
+			e->rank = rank++;
+			if (!e->stats)
+				e->stats = stats_rule(list_names[i], e->str);
+		}
+	}
+
+	/* The old index points at the old entries */
+	addr_index_free(addr_index);
+	addr_index = NULL;
+
+	match_entries = malloc((n + 1) * sizeof(struct entry *));
+	if (!match_entries)
+		goto failed;
+	free(entry_hits);
+	entry_hits = calloc(n + 1, sizeof(unsigned));
+	n_entries = entry_hits ? n + 1 : 0;
+
+	for (id = 0, i = 0; i < N_LISTS; ++i)
+		for (e = *match_lists[i]; e; e = e->next)
+			match_entries[id++] = e;
+
+	bulk_entry.index = bulk_entry.rank = n;
+	match_entries[n] = &bulk_entry;
+	if (!bulk_entry.stats)
+		bulk_entry.stats = stats_rule("blacklist", bulk_entry.str);
+
+	/* Without the index the addresses go in the matchers instead */
+	if (!(addr_index = index_addresses(n)))
+		logmsg(LOG_WARNING, "Unable to index addresses");
+
+	field_mask = 0;
+	for (f = 0; f < N_FIELDS; ++f) {
+		if (!(matchers[f] = matcher_new()))
+			goto failed;
+
+		if (n_bulk && in_field(&bulk_entry, f)) {
+			field_mask |= 1 << f;
+			if (!addr_index) {
+				const char *str = bulk;
+				for (unsigned j = 0; j < n_bulk; ++j, str += strlen(str) + 1)
+					if (matcher_add(matchers[f], str, n))
+						goto failed;
+			}
+		}
+
+		for (id = 0; id < n; ++id)
+			if (in_field(match_entries[id], f)) {
+				field_mask |= 1 << f;
+				if (!indexed(match_entries[id]))
+					if (matcher_add(matchers[f], match_entries[id]->match, id))
+						goto failed;
+			}
+
+		if (matcher_compile(matchers[f]))
+			goto failed;
+	}
+
+	return;
+
+failed:
+	logmsg(LOG_WARNING, "Unable to compile lists");
+	/* The fallback walk can match in any field, so fetch them all */
+	field_mask = (1 << N_FIELDS) - 1;
+	for (f = 0; f < N_FIELDS; ++f) {
+		matcher_free(matchers[f]);
+		matchers[f] = NULL;
+	}
+}
+
+static void note_hit(unsigned id, void *arg)
+{
+	const struct entry **hits = arg;
+	const struct entry *e = match_entries[id];
+
+	if (!hits[e->list] || e->rank < hits[e->list]->rank)
+		hits[e->list] = e;
+}
+
+struct addr_hit {
+	const struct entry **hits;
+	int field;
+};
+
+static void note_addr(unsigned id, void *arg)
+{
+	struct addr_hit *ah = arg;
+
+	if (in_field(match_entries[id], ah->field))
+		note_hit(id, ah->hits);
+}
+
+/* Sets hits[list] to the first entry in each list that matches the
+ * line. One pass over the line covers all the lists checked for the
+ * field. Addresses and domains only match the addresses in address
+ * fields.
+ */
+void match_line(int field, const char *line, const struct entry **hits)
+{
+	uint64_t start = stats_clock();
+	int i;
+
+	memset(hits, 0, N_LISTS * sizeof(struct entry *));
+
+	if (addr_index && fields[field].addresses) {
+		struct addr_hit ah = { .hits = hits, .field = field };
+		addr_scan(addr_index, line, note_addr, &ah);
+	}
+
+	if (matchers[field])
+		matcher_scan(matchers[field], line, note_hit, hits);
+	else {
+		for (i = 0; i < N_LISTS; ++i)
+			for (struct entry *e = *match_lists[i]; e; e = e->next)
+				if (in_field(e, field) && !indexed(e) &&
+					fast_strcasestr(line, e->match)) {
+					hits[i] = e;
+					break;
+				}
+
+		/* The bulk entry comes after the whole blacklist */
+		if (!addr_index && !hits[BLACKLIST] && n_bulk && in_field(&bulk_entry, field)) {
+			const char *str = bulk;
+			for (unsigned j = 0; j < n_bulk; ++j, str += strlen(str) + 1)
+				if (fast_strcasestr(line, str)) {
+					hits[BLACKLIST] = &bulk_entry;
+					break;
+				}
+		}
+	}
+
+	stats_add(scan_stats, 0, stats_clock() - start);
+	for (i = 0; i < N_LISTS; ++i)
+		if (hits[i]) {
+			stats_add(hits[i]->stats, 1, 0);
+			if (hits[i]->index < n_entries && i != FOLDERLIST) {
+				++entry_hits[hits[i]->index];
+				++new_hits;
+			}
+		}
+}
+
+/* Adaptive ordering
+ *
+ * The first entry that matches wins, but only the folders care which
+ * one. So the whitelist, graylist, and blacklist are kept sorted by
+ * hits, hottest first, every REORDER_HITS hits and when the config is
+ * read. Sorting only relinks the lists and sets the ranks. The index
+ * is the matcher id, so it stays and the matchers are not rebuilt.
+ * The hits are saved in ~/.rtf.order so a restart keeps the order.
+ */
+#define REORDER_HITS 1000
+
+static int cmp_hits(const void *a, const void *b)
+{
+	const struct entry *e1 = *(const struct entry **)a;
+	const struct entry *e2 = *(const struct entry **)b;
+
+	if (e1->hits != e2->hits)
+		return e1->hits < e2->hits ? 1 : -1;
+	return e1->rank < e2->rank ? -1 : e1->rank > e2->rank;
+}
+
+/* Stable sort of the list by hits */
+static void sort_list(struct entry **head)
+{
+	struct entry *e, **array;
+	unsigned i, n = 0;
+
+	for (e = *head; e; e = e->next)
+		e->rank = n++;
+	if (n < 2 || !(array = malloc(n * sizeof(struct entry *))))
+		return;
+
+	for (i = 0, e = *head; e; e = e->next)
+		array[i++] = e;
+
+	qsort(array, n, sizeof(struct entry *), cmp_hits);
+
+	*head = array[0];
+	for (i = 0; i < n; ++i) {
+		array[i]->prev = i > 0 ? array[i - 1] : NULL;
+		array[i]->next = i + 1 < n ? array[i + 1] : NULL;
+		array[i]->rank = i;
+	}
+
+	free(array);
+}
+
+static void sort_lists(void)
+{
+	sort_list(&whitelist);
+	sort_list(&graylist);
+	sort_list(&blacklist);
+}
+
+static void save_order(void)
+{
+	char fname[128], tmpname[140];
+
+	snprintf(fname, sizeof(fname), "%s/.rtf.order", home);
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+	FILE *fp = fopen(tmpname, "w");
+	if (!fp) {
+		logmsg(LOG_WARNING, "%s: %m", tmpname);
+		return;
+	}
+
+	for (int i = 0; i < N_LISTS; ++i)
+		if (i != FOLDERLIST)
+			for (struct entry *e = *match_lists[i]; e; e = e->next)
+				if (e->hits + entry_hits[e->index])
+					fprintf(fp, "%u %s %s\n", e->hits + entry_hits[e->index],
+							list_names[i], e->str);
+
+	if (fclose(fp) || rename(tmpname, fname)) {
+		logmsg(LOG_WARNING, "%s: write failed", tmpname);
+		unlink(tmpname);
+	}
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+	const struct entry *e1 = *(const struct entry **)a;
+	const struct entry *e2 = *(const struct entry **)b;
+
+	if (e1->list != e2->list)
+		return e1->list - e2->list;
+	return strcmp(e1->str, e2->str);
+}
+
+/* Restore the saved hits */
+static void load_order(void)
+{
+	char fname[128], line[256];
+	struct entry *e, **array;
+	unsigned n = 0;
+	int i;
+
+	snprintf(fname, sizeof(fname), "%s/.rtf.order", home);
+	FILE *fp = fopen(fname, "r");
+	if (!fp)
+		return;
+
+	for (i = 0; i < N_LISTS; ++i)
+		for (e = *match_lists[i]; e; e = e->next) {
+			e->list = i;
+			++n;
+		}
+
+	if (n == 0 || !(array = malloc(n * sizeof(struct entry *)))) {
+		fclose(fp);
+		return;
+	}
+
+	for (n = 0, i = 0; i < N_LISTS; ++i)
+		for (e = *match_lists[i]; e; e = e->next)
+			array[n++] = e;
+	qsort(array, n, sizeof(struct entry *), cmp_name);
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *name, *str = strtok(line, "\r\n");
+		unsigned hits = strtoul(line, &name, 10);
+		struct entry key, *keyp = &key, **found;
+
+		if (!str || *name++ != ' ' || !(str = strchr(name, ' ')))
+			continue;
+		*str++ = 0;
+
+		for (key.list = 0; key.list < N_LISTS; ++key.list)
+			if (strcmp(name, list_names[key.list]) == 0)
+				break;
+		key.str = str;
+
+		found = bsearch(&keyp, array, n, sizeof(struct entry *), cmp_name);
+		if (found)
+			(*found)->hits = hits;
+	}
+
+	free(array);
+	fclose(fp);
+}
+
+/* Returns a mask of the fields that some entry can match */
+unsigned rule_fields(void)
+{
+	return field_mask;
+}
+
+/* Move the new hits into the entries before they can go away */
+static void add_hits(void)
+{
+	for (unsigned i = 0; i < n_entries; ++i)
+		if (entry_hits[i]) {
+			match_entries[i]->hits += entry_hits[i];
+			entry_hits[i] = 0;
+		}
+}
+
+/* Called now and then to sort the lists and save the hits */
+void reorder_lists(void)
+{
+	if (new_hits < REORDER_HITS || n_entries == 0)
+		return;
+	new_hits = 0;
+
+	add_hits();
+	sort_lists();
+	save_order();
+}
+
 static int read_config_file(const char *fname)
 {
 	struct entry **head = NULL;
@@ -221,6 +723,12 @@ int read_config(void)
 	if (!home)
 		get_home();
 
+	add_hits();
+
+	/* The bulk entries are reread every time */
+	bulk_len = 0;
+	n_bulk = 0;
+
 	snprintf(fname, sizeof(fname), "%s/.rtf", home);
 	rc = read_config_file(fname);
 
@@ -250,6 +758,11 @@ int read_config(void)
 	check_list(&blacklist);
 	check_list(&folderlist);
 
+	if (generation == 0)
+		load_order();
+	sort_lists();
+	compile_lists();
+
 	// If needed, un-obfuscate password and create passwd entry
 	unobfuscate(get_global("password"));
 
@@ -265,7 +778,7 @@ int read_config(void)
 		logmsg(LOG_ERR, "graylist global missing");
 		rc = 1;
 	}
-	if (blacklist && !get_global("blacklist")) {
+	if ((blacklist || n_bulk) && !get_global("blacklist")) {
 		logmsg(LOG_ERR, "blacklist global missing");
 		rc = 1;
 	}
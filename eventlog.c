@@ -0,0 +1,69 @@
+/* Event log
+ *
+ * rtf, imap-rtf, and learnem all append to the same log. Each record
+ * is formatted by the caller and written with one write() to an
+ * O_APPEND descriptor. The records are well under PIPE_BUF so they
+ * never get mixed up and no lock is needed.
+ *
+ * The descriptor stays open. It is reopened after a SIGHUP, or when
+ * logrotate has moved the file away (checked at most once a second).
+ */
+#include "rtf.h"
+#include <signal.h>
+
+static const char *log_fname;
+static int log_fd = -1;
+static ino_t log_ino;
+static time_t log_checked;
+static volatile sig_atomic_t log_hup;
+
+static void hup(int signo)
+{
+	log_hup = 1;
+}
+
+static int reopen(void)
+{
+	struct stat sbuf;
+
+	int fd = open(log_fname, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		syslog(LOG_ERR, "%s: %m", log_fname);
+		return -1;
+	}
+	if (fstat(fd, &sbuf) == 0)
+		log_ino = sbuf.st_ino;
+
+	if (log_fd >= 0)
+		close(log_fd);
+	log_fd = fd;
+	log_checked = time(NULL);
+	return 0;
+}
+
+int eventlog_open(const char *fname)
+{
+	log_fname = fname;
+	signal(SIGHUP, hup);
+	return reopen();
+}
+
+void eventlog_write(const char *rec, size_t len)
+{
+	struct stat sbuf;
+
+	if (!log_fname)
+		return;
+
+	if (log_hup || log_fd < 0) {
+		log_hup = 0;
+		reopen();
+	} else if (time(NULL) != log_checked) {
+		log_checked = time(NULL);
+		if (stat(log_fname, &sbuf) || sbuf.st_ino != log_ino)
+			reopen();
+	}
+
+	if (log_fd < 0 || write(log_fd, rec, len) != len)
+		syslog(LOG_ERR, "%s: write error", log_fname);
+}
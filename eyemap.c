@@ -1,36 +1,158 @@
+#include "rtf.h" /* first for _GNU_SOURCE */
+
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
-#include "rtf.h"
-
 char reply[BUFFER_SIZE];
 static char *curline;
 static int cmdno;
 int is_exchange;
+int has_move;
+int has_uidplus;
 
 unsigned uidvalidity;
 unsigned last_seen = 1;
 
-int send_cmd(const char *cmd)
+/* Pipelining. Commands are queued with imap_queue() and all go out
+ * in one flush when we next wait. The tagged completion goes to the
+ * command's done() and an untagged response goes to the oldest
+ * command that wants it. The callbacks can queue more commands but
+ * must not wait or call send_recv().
+ */
+#define MAX_PENDING 128
+
+static struct pending {
+	unsigned tag;
+	const char *want;
+	untagged_fn untagged;
+	done_fn done;
+	void *arg;
+} pending[MAX_PENDING];
+static int n_pending;
+static int need_flush;
+
+/* The response parser. Each byte is looked at once, as it arrives,
+ * and the state lives across reads and imap_wait() calls since the
+ * responses to later commands may already be in reply. Literals are
+ * skipped over by count.
+ */
+enum { S_TEXT, S_QUOTED, S_ESCAPE, S_LITLEN, S_LITCR, S_LITERAL };
+
+#define READ_MIN (16 * 1024)
+
+static char *msg = reply;	/* start of the current response */
+static char *scan = reply;	/* next byte to look at */
+static char *end = reply;	/* end of the data */
+static char *base = reply;	/* responses are slid down to here */
+static int collect;			/* send_recv() keeps all the responses */
+static int state;
+static int spaces;
+static size_t count;		/* literal bytes left */
+static size_t lit_size;
+static int cut;				/* the response was too big */
+/* These are offsets from msg, 0 for none */
+static size_t lit_off, code_off, code_len, cut_off;
+
+size_t imap_bytes;
+
+static void reset_parser(void)
 {
-	++cmdno;
-	int n = sprintf(reply, "a%03d %s\r\n", cmdno, cmd);
+	msg = scan = end = base = reply;
+	collect = 0;
+	state = S_TEXT;
+	spaces = 0;
+	lit_off = code_off = code_len = 0;
+	cut = 0;
+}
 
-	if (verbose > 1)
-		printf("C: %s", reply);
+/* Returns 1 when scan is at the end of a response */
+static int parse(void)
+{
+	while (scan < end) {
+		if (state == S_LITERAL) {
+			size_t n = end - scan;
+			if (n > count)
+				n = count;
+			scan += n;
+			count -= n;
+			if (count == 0)
+				state = S_TEXT;
+			continue;
+		}
 
-	return ssl_write(reply, n);
+		int c = *scan++;
+		switch (state) {
+		case S_LITCR:
+			if (c == '\r')
+				break;
+			if (c == '\n') {
+				lit_off = scan - msg;
+				lit_size = count;
+				state = count ? S_LITERAL : S_TEXT;
+				break;
+			}
+			goto text;
+		case S_LITLEN:
+			if (isdigit(c)) {
+				count = count * 10 + c - '0';
+				break;
+			} else if (c == '}') {
+				state = S_LITCR;
+				break;
+			}
+			/* fall thru */
+		case S_TEXT:
+		text:
+			state = S_TEXT;
+			switch (c) {
+			case ' ':
+				++spaces;
+				break;
+			case '"':
+				state = S_QUOTED;
+				break;
+			case '{':
+				count = 0;
+				state = S_LITLEN;
+				break;
+			case '[':
+				/* A response code follows the status */
+				if (spaces == 2 && code_off == 0 && scan[-2] == ' ')
+					code_off = scan - msg;
+				break;
+			case ']':
+				if (code_off && code_len == 0)
+					code_len = scan - 1 - msg - code_off;
+				break;
+			case '\n':
+				return 1;
+			}
+			break;
+		case S_QUOTED:
+			if (c == '\\')
+				state = S_ESCAPE;
+			else if (c == '"')
+				state = S_TEXT;
+			else if (c == '\n') /* broken quote */
+				return 1;
+			break;
+		case S_ESCAPE:
+			state = S_QUOTED;
+			break;
+		}
+	}
+
+	return 0;
 }
 
-static void uid_validity(void)
+static void uid_validity(struct response *r)
 {
-	char *p = strstr(reply, "[UIDVALIDITY");
-	if (p) {
+	if (r->code_len > 12 && strncasecmp(r->code, "UIDVALIDITY ", 12) == 0) {
 		char *e;
-		unsigned valid = strtol(p + 12, &e, 10);
-		if (*e == ']') {
+		unsigned valid = strtoul(r->code + 12, &e, 10);
+		if (e == r->code + r->code_len) {
 			if (uidvalidity) {
 				if (uidvalidity != valid) {
 					logmsg(LOG_INFO, "RESET: uidvalidity was %u now %u", uidvalidity, valid);
@@ -43,63 +165,15 @@ static void uid_validity(void)
 	}
 }
 
-int send_recv(const char *fmt, ...)
+int send_cmd(const char *cmd)
 {
-	char match[16], *p;
-	int n;
-
-	curline = reply;
-
-	if (fmt) {
-		va_list ap;
-
-		++cmdno;
-		n = sprintf(reply, "a%03d ", cmdno);
-		va_start(ap, fmt);
-		n += vsnprintf(reply + n, sizeof(reply) - n - 2, fmt, ap);
-		va_end(ap);
-		strcpy(reply + n, "\r\n");
-
-		if (verbose > 1) {
-			if (strncmp(fmt, "LOGIN", 5) == 0)
-				printf("C: LOGIN\n");
-			else
-				printf("C: %s", reply);
-		}
-
-		n = ssl_write(reply, n + 2);
-		if (n <= 0)
-			return -1;
-
-		sprintf(match, "a%03d ", cmdno);
-	} else
-		strcpy(match, "* ");
-
-	char *cur = reply;
-	int len = sizeof(reply);
-	while (1) {
-		n = ssl_read(cur, len - 1);
-		if (n < 0)
-			return -1;
-
-		uid_validity();
-
-		cur[n] = 0;
-		if (verbose > 1)
-			printf("S:%d: %s", n, cur);
-		if ((p = strstr(cur, match))) {
-			p += strlen(match);
-			if (strncmp(p, "OK ", 3) == 0)
-				return 0;
-			return 1;
-		}
+	++cmdno;
+	int n = sprintf(reply, "a%03d %s\r\n", cmdno, cmd);
 
-		cur += n;
-		len -= n;
+	if (verbose > 1)
+		printf("C: %s", reply);
 
-		if (len < 2)
-			return 0; /* try with what we have */
-	}
+	return ssl_write(reply, n);
 }
 
 /* The only purpose of this function is to not display the email
@@ -129,6 +203,278 @@ int fetch(unsigned uid)
 	return rc;
 }
 
+static unsigned vqueue(const char *want, untagged_fn untagged, done_fn done, void *arg,
+					   const char *fmt, va_list ap)
+{
+	static char cmd[16 * 1024];
+
+	if (n_pending >= MAX_PENDING) {
+		logmsg(LOG_ERR, "Too many commands in flight");
+		return 0;
+	}
+
+	int n = sprintf(cmd, "a%03d ", ++cmdno);
+	n += vsnprintf(cmd + n, sizeof(cmd) - n - 2, fmt, ap);
+	if (n >= sizeof(cmd) - 2) {
+		logmsg(LOG_ERR, "Command too long");
+		return 0;
+	}
+	strcpy(cmd + n, "\r\n");
+
+	if (verbose > 1) {
+		if (strncmp(fmt, "LOGIN", 5) == 0)
+			printf("C: LOGIN\n");
+		else
+			printf("C: %s", cmd);
+	}
+
+	if (ssl_queue(cmd, n + 2) <= 0)
+		return 0;
+	need_flush = 1;
+
+	struct pending *p = &pending[n_pending++];
+	p->tag = cmdno;
+	p->want = want;
+	p->untagged = untagged;
+	p->done = done;
+	p->arg = arg;
+	return cmdno;
+}
+
+unsigned imap_queue(const char *want, untagged_fn untagged, done_fn done, void *arg,
+					const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	unsigned tag = vqueue(want, untagged, done, arg, fmt, ap);
+	va_end(ap);
+	return tag;
+}
+
+static void dispatch(struct response *r)
+{
+	char *p = r->line;
+	int i;
+
+	uid_validity(r);
+
+	if (*p == '*') {
+		if (n_pending && pending[0].tag == 0) {
+			/* The greeting */
+			n_pending = 0;
+			r->rc = strncasecmp(p, "* OK ", 5) ? 1 : 0;
+			return;
+		}
+
+		/* Skip the message number in "* 12 FETCH" */
+		for (++p; *p == ' ' || isdigit(*p); ++p) ;
+		for (i = 0; i < n_pending; ++i) {
+			struct pending *c = &pending[i];
+			int len = c->want ? strlen(c->want) : 0;
+			if (len && strncasecmp(p, c->want, len) == 0 &&
+				(p[len] == ' ' || p[len] == '\r' || p[len] == '\n')) {
+				c->untagged(r, c->arg);
+				return;
+			}
+		}
+		return;
+	}
+
+	if (*p++ != 'a')
+		return; /* continuation */
+
+	unsigned tag = strtoul(p, &p, 10);
+	for (i = 0; i < n_pending; ++i)
+		if (pending[i].tag == tag) {
+			struct pending c = pending[i];
+			memmove(&pending[i], &pending[i + 1], (--n_pending - i) * sizeof(c));
+			r->rc = strncasecmp(p, " OK ", 4) ? 1 : 0;
+			r->tag = tag;
+			if (c.done)
+				c.done(r->rc, c.arg);
+			return;
+		}
+}
+
+/* Read and dispatch responses until the command with tag is done, or
+ * until all commands are done if tag is 0. Returns the command's
+ * result, or the last command's with tag 0: 0 for OK, 1 for NO or
+ * BAD, -1 if the connection failed.
+ */
+int imap_wait(unsigned tag)
+{
+	struct response r = { .rc = 0 };
+
+	while (n_pending) {
+		if (parse()) {
+			r.line = msg;
+			r.end = cut ? msg + cut_off : scan;
+			r.lit = NULL;
+			r.lit_len = 0;
+			if (lit_off) {
+				r.lit = msg + lit_off;
+				if (r.lit > r.end)
+					r.lit = r.end;
+				r.lit_len = lit_size;
+				if (r.lit + r.lit_len > r.end)
+					r.lit_len = r.end - r.lit;
+			}
+			r.code = msg + code_off;
+			r.code_len = code_len;
+			r.tag = 0;
+
+			if (verbose > 1)
+				printf("S: %.*s", (int)((r.lit ? r.lit : r.end) - msg), msg);
+			if (verbose > 2 && r.lit)
+				printf("%.*s", (int)r.lit_len, r.lit);
+
+			dispatch(&r);
+
+			msg = scan;
+			spaces = 0;
+			lit_off = code_off = code_len = 0;
+			cut = 0;
+			if (tag && r.tag == tag)
+				return r.rc;
+			continue;
+		}
+
+		/* Need more data. Drop anything past a cut and send anything
+		 * queued first.
+		 */
+		if (cut)
+			scan = end = msg + cut_off;
+
+		if (need_flush) {
+			need_flush = 0;
+			if (ssl_flush())
+				return -1;
+		}
+
+		/* When send_recv() fills reply it keeps what it has. The
+		 * responses after that only need their first line or so.
+		 */
+		char *limit = reply + BUFFER_SIZE - 1 - READ_MIN;
+		if (end > limit && collect) {
+			collect = 0;
+			base = limit - 1024;
+			if (msg < base) {
+				cut = 1;
+				cut_off = base - msg;
+				scan = end = base;
+			}
+			logmsg(LOG_WARNING, "Response truncated");
+		}
+
+		if (!collect && msg > base) {
+			size_t off = msg - base;
+			memmove(base, msg, end - msg);
+			end -= off;
+			scan -= off;
+			msg = base;
+		}
+
+		if (end > limit) {
+			cut = 1;
+			cut_off = limit - msg;
+			scan = end = limit;
+		}
+
+		int n = ssl_read(end, reply + BUFFER_SIZE - 1 - end);
+		if (n <= 0)
+			return -1;
+		end += n;
+		imap_bytes += n;
+	}
+
+	return r.rc;
+}
+
+/* Send one command and wait for it. All the responses, literals
+ * included, are left in reply for the caller. If they do not fit the
+ * rest are dropped, but we still wait for the command to finish. With
+ * no fmt, wait for the server greeting.
+ */
+int send_recv(const char *fmt, ...)
+{
+	unsigned tag;
+	int rc;
+
+	if (n_pending && imap_wait(0) < 0)
+		return -1;
+
+	/* Anything left over is unsolicited */
+	reset_parser();
+	collect = 1;
+
+	if (fmt) {
+		va_list ap;
+
+		va_start(ap, fmt);
+		tag = vqueue(NULL, NULL, NULL, NULL, fmt, ap);
+		va_end(ap);
+		if (tag == 0)
+			return -1;
+	} else {
+		/* The greeting is the only command with tag 0 */
+		pending[0].tag = 0;
+		pending[0].want = NULL;
+		pending[0].done = NULL;
+		n_pending = 1;
+		tag = 0;
+	}
+
+	rc = imap_wait(tag);
+
+	/* The kept responses end at msg unless they were cut */
+	*(collect ? msg : base) = 0;
+	curline = reply;
+	reset_parser();
+
+	return rc;
+}
+
+/* Parse the UID out of the FETCH response text between p and e */
+static unsigned fetch_uid(const char *p, const char *e)
+{
+	const char *u = memmem(p, e - p, "UID ", 4);
+	return u ? strtoul(u + 4, NULL, 10) : 0;
+}
+
+static void fetched(struct response *r, void *arg)
+{
+	void (*fn)(unsigned uid, size_t len) = arg;
+
+	if (!r->lit)
+		return;
+
+	char *lit_end = r->lit + r->lit_len;
+	unsigned uid = fetch_uid(r->line, r->lit);
+	if (uid == 0)
+		uid = fetch_uid(lit_end, r->end);
+
+	/* The byte after the literal has been looked at */
+	*lit_end = 0;
+	curline = r->lit;
+	if (uid)
+		fn(uid, r->lit_len);
+	curline = NULL;
+}
+
+/* Queue a fetch of item, such as BODY.PEEK[HEADER], for the UIDs
+ * first to last. As soon as a message's response is in, fn() is
+ * called with the literal's length and fetchline() set up on the
+ * literal. A literal too big for reply is truncated and the rest
+ * dropped.
+ */
+unsigned fetch_queue(unsigned first, unsigned last, const char *item,
+					 void (*fn)(unsigned uid, size_t len))
+{
+	return imap_queue("FETCH", fetched, NULL, fn,
+					  "UID FETCH %u:%u (UID %s)", first, last, item);
+}
+
 int fetchline(char *line, int len)
 {
 	if (!curline)
@@ -143,6 +489,17 @@ int fetchline(char *line, int len)
 	return 1;
 }
 
+/* Is cap in the CAPABILITY response? */
+static int capable(const char *cap)
+{
+	int len = strlen(cap);
+
+	for (char *p = reply; (p = fast_strcasestr(p, cap)); p += len)
+		if (p > reply && *(p - 1) == ' ' && (p[len] == ' ' || p[len] == '\r'))
+			return 1;
+	return 0;
+}
+
 static uint32_t host_ip;
 
 int connect_to_server(const char *server, int port,
@@ -176,6 +533,15 @@ int connect_to_server(const char *server, int port,
 		goto failed;
 	}
 
+	/* Fail anything in flight on the old connection */
+	while (n_pending > 0) {
+		struct pending *c = &pending[--n_pending];
+		if (c->done)
+			c->done(-1, c->arg);
+	}
+	need_flush = 0;
+	reset_parser();
+
 	if (ssl_open(sock, server)) {
 		logmsg(LOG_ERR, "ssl_open failed");
 		goto failed;
@@ -186,13 +552,18 @@ int connect_to_server(const char *server, int port,
 		goto failed;
 	}
 
-	is_exchange = strstr(reply, "Microsoft Exchange") != NULL;
+	is_exchange = fast_strcasestr(reply, "Microsoft Exchange") != NULL;
 
 	if (send_recv("LOGIN %s %s", user, passwd)) {
 		logmsg(LOG_ERR, "Login failed");
 		goto failed;
 	}
 
+	if (send_recv("CAPABILITY") == 0) {
+		has_move = capable("MOVE");
+		has_uidplus = capable("UIDPLUS");
+	}
+
 	if (send_recv("SELECT INBOX")) {
 		logmsg(LOG_ERR, "Select failed");
 		goto failed;
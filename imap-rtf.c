@@ -38,6 +38,31 @@
  *     john Smith=inbox
  *     smith=Smith Folder
  * This would put all Smith's in the Smith Folder except John Smith.
+ *
+ * Entries in the lists can be limited to one header field with a
+ * to:, from:, subject:, list:, reply-to:, or return-path: prefix. To:
+ * covers To, Cc, and Bcc, list: is List-Post. For example:
+ *     [blacklist]
+ *     subject:casino
+ * only checks the subject. Start the entry with a \ if you really
+ * want to match from: and friends.
+ *
+ * A full address such as bob@example.com only matches that exact
+ * address and *.example.com matches example.com and all its
+ * subdomains. These are looked up in the address fields, not matched
+ * as substrings, so they cost nothing per entry. A \ also turns this
+ * off.
+ *
+ * Plain addresses and domains in the blacklist are stored compactly,
+ * so large spam feeds can be dropped in .rtf.d. A Bloom filter sits
+ * in front of the addresses, bloom_fp in global sets its false
+ * positive rate (default 0.01, 0 for no filter).
+ *
+ * Only the header fields that the rules can match are fetched, plus
+ * From, Date, and Subject. header_max in global caps the bytes
+ * fetched per message (default no cap). The server sends the fields
+ * in message order, so a capped header may be missing From or Date
+ * and is not called spam for that.
  */
 
 #include "rtf.h"
@@ -58,12 +83,35 @@ static const char *folder_match;
 
 static char buff[BUFFER_SIZE];
 
-#define MAX_UIDS 100
+#define MAX_UIDS 1024
 static unsigned uidlist[MAX_UIDS];
 static int n_uids;
 static int did_delete;
 static int reread_config;
-static unsigned cur_uid;
+
+/* The headers for a batch of UIDs are fetched with one command and
+ * filtered as they arrive. Nothing can be sent until the FETCH is
+ * done, so the decisions are saved and acted on after.
+ */
+static struct decision {
+	unsigned uid;
+	char action;
+	const char *path;
+	char subject[66];
+} decisions[MAX_UIDS];
+static int n_decisions;
+
+/* A batch should take a few round trips worth of transfer so the
+ * round trip is lost in the noise, but not so long that the moves
+ * are held back. The round trip comes from the UID SEARCH.
+ */
+#define BATCH_RTTS	4
+#define BATCH_BYTES	(2 * 1024 * 1024)
+
+static double rtt;					/* seconds */
+static double msg_time = 0.001;		/* transfer seconds per message */
+static double msg_bytes = 8192;
+static int batch_size = 8;
 
 static void logit(char action, const char *subject, unsigned cur_uid)
 {
@@ -83,88 +131,164 @@ static void logit(char action, const char *subject, unsigned cur_uid)
 	if (!log_verbose && (action == 'h' || action == 'H'))
 		return;
 
-	FILE *fp = fopen(logfile, "a");
-	if (!fp) {
-		logmsg(LOG_ERR, "%s: %m", logfile);
-		return;
-	}
+	char rec[96];
+	int len = snprintf(rec, sizeof(rec), "%10u %c %.65s\n", cur_uid, action, subject);
+	eventlog_write(rec, len);
+}
 
-	if (flock(fileno(fp), LOCK_EX)) {
-		logmsg(LOG_ERR, "%s: flock: %m", logfile);
-		/* keep going even if we don't get the lock */
+/* Compress the sorted uids into a UID set such as 1:4,7,9:10 */
+static void uid_set(char *set, const unsigned *uids, int n)
+{
+	for (int i = 0; i < n; ) {
+		int j = i;
+		while (j + 1 < n && uids[j + 1] == uids[j] + 1)
+			++j;
+		if (j > i)
+			set += sprintf(set, "%s%u:%u", i ? "," : "", uids[i], uids[j]);
+		else
+			set += sprintf(set, "%s%u", i ? "," : "", uids[i]);
+		i = j + 1;
 	}
+}
 
-	fprintf(fp, "%10u %c %.65s\n", cur_uid, action, subject);
+/* Move the messages to path with UID MOVE (RFC 6851). Without MOVE,
+ * fall back to COPY and delete, with UID EXPUNGE (RFC 4315) if we
+ * can so other deleted messages are left alone.
+ *
+ * The moves are pipelined with the fetches. Each step is queued when
+ * the step before it is OK, so a failed COPY never deletes.
+ */
+enum { MOVE_START, MOVE_SEEN, MOVE_MOVE, MOVE_COPY, MOVE_DELETE,
+	   MOVE_EXPUNGE, MOVE_DONE };
 
-	if (ferror(fp))
-		logmsg(LOG_ERR, "%s: write error", logfile);
+struct move {
+	int step;
+	unsigned first;		/* first uid of the batch */
+	const char *path;
+	char set[];
+};
 
-	fclose(fp);
-}
+/* First uid of the earliest batch with a failed move */
+static unsigned failed_uid;
 
-static int safe_rename(const char *path)
+/* Queues the next step */
+static void move_done(int rc, void *arg)
 {
-	if (dry_run) {
-		printf("Action %c\n", action);
-		return 0;
-	}
+	struct move *m = arg;
+	const char *path = m->path + (*m->path == '+');
+	unsigned tag = 0;
 
-	if (*path == '+') {
-		++path;
+	if (rc)
+		goto failed;
 
-		if (send_recv("UID STORE %u +FLAGS.SILENT (\\Seen)", cur_uid))
-			return -1;
+	switch (m->step) {
+	case MOVE_START:
+		if (*m->path == '+') {
+			m->step = MOVE_SEEN;
+			break;
+		}
+		/* fall thru */
+	case MOVE_SEEN:
+		m->step = has_move ? MOVE_MOVE : MOVE_COPY;
+		break;
+	case MOVE_COPY:
+		m->step = MOVE_DELETE;
+		break;
+	case MOVE_DELETE:
+		if (has_uidplus) {
+			m->step = MOVE_EXPUNGE;
+			break;
+		}
+		did_delete = 1;
+		/* fall thru */
+	default:
+		free(m);
+		return;
+	}
+
+	switch (m->step) {
+	case MOVE_SEEN:
+		tag = imap_queue(NULL, NULL, move_done, m,
+						 "UID STORE %s +FLAGS.SILENT (\\Seen)", m->set);
+		break;
+	case MOVE_MOVE:
+		tag = imap_queue(NULL, NULL, move_done, m, "UID MOVE %s %s", m->set, path);
+		break;
+	case MOVE_COPY:
+		tag = imap_queue(NULL, NULL, move_done, m, "UID COPY %s %s", m->set, path);
+		break;
+	case MOVE_DELETE:
+		tag = imap_queue(NULL, NULL, move_done, m,
+						 "UID STORE %s +FLAGS.SILENT (\\Deleted \\Seen)", m->set);
+		break;
+	case MOVE_EXPUNGE:
+		tag = imap_queue(NULL, NULL, move_done, m, "UID EXPUNGE %s", m->set);
+		break;
 	}
+	if (tag)
+		return;
+
+failed:
+	logmsg(LOG_WARNING, "Move to %s failed", path);
+	if (failed_uid == 0 || m->first < failed_uid)
+		failed_uid = m->first;
+	free(m);
+}
 
-	if (send_recv("UID COPY %u %s", cur_uid, path))
+/* Failures show up in failed_uid */
+static int move_uids(const char *path, const unsigned *uids, int n, unsigned first)
+{
+	struct move *m = malloc(sizeof(struct move) + n * 12);
+	if (!m) {
+		logmsg(LOG_ERR, "Out of memory");
 		return -1;
+	}
 
-	did_delete = 1;
-	return send_recv("UID STORE %u +FLAGS.SILENT (\\Deleted \\Seen)", cur_uid);
+	uid_set(m->set, uids, n);
+	m->path = path;
+	m->first = first;
+	m->step = MOVE_START;
+	move_done(0, m);
+	return 0;
 }
 
-static int ham(void)
+/* ham(), spam(), and ignore() return the folder to move to or NULL */
+static const char *ham(void)
 {
 	if (folder_match && strcmp(folder_match, "inbox")) {
 		action = 'f';
-		return safe_rename(folder_match);
+		return folder_match;
 	}
-	return 0;
+	return NULL;
 }
 
-static inline int spam(void)
+static inline const char *spam(void)
 {
 	const char *bl = get_global("blacklist");
-	if (!bl) {
+	if (!bl)
 		/* This can happen with no from and/or date */
 		logmsg(LOG_WARNING, "Spam and no blacklist in global section");
-		return 0;
-	}
-	return safe_rename(bl);
+	return bl;
 }
 
-static inline int ignore(void) { return safe_rename(get_global("graylist")); }
+static inline const char *ignore(void) { return get_global("graylist"); }
 
-static const struct entry *list_filter(const char *line, struct entry * const head)
-{
-	struct entry *e;
+static const struct entry *hits[N_LISTS];
 
-	for (e = head; e; e = e->next)
-		if (strcasestr(line, e->str))
-			return e;
-
-	return NULL;
+/* match_line() must be called on the line first */
+static inline const struct entry *list_filter(int list)
+{
+	return hits[list];
 }
 
-static inline void filter_from(const char *from)
+static inline void filter_from(int field, const char *from)
 {
-	const struct entry *e;
-
-	if (list_filter(from, whitelist))
+	match_line(field, from, hits);
+	if (list_filter(WHITELIST))
 		flags |= IS_HAM;
-	if (list_filter(from, graylist))
+	if (list_filter(GRAYLIST))
 		flags |= IS_IGNORED;
-	if ((e = list_filter(from, blacklist)))
+	if (list_filter(BLACKLIST))
 		flags |= IS_SPAM;
 }
 
@@ -189,7 +313,75 @@ static void normalize_subject(const char *str)
 	subject[end + 1] = 0;
 }
 
-static int filter(void)
+/* Header lookup. A perfect hash on the length and the first and last
+ * characters of the header name picks the only possible header.
+ */
+#define FIELD_DATE N_FIELDS
+
+static const struct header {
+	const char *name;
+	int len;
+	int field;
+} headers[16] = {
+	[2]  = { "return-path", 11, FIELD_RETURN_PATH },
+	[4]  = { "cc", 2, FIELD_TO },
+	[5]  = { "list-post", 9, FIELD_LIST },
+	[8]  = { "date", 4, FIELD_DATE },
+	[9]  = { "subject", 7, FIELD_SUBJECT },
+	[10] = { "bcc", 3, FIELD_TO },
+	[12] = { "from", 4, FIELD_FROM },
+	[13] = { "reply-to", 8, FIELD_REPLY_TO },
+	[14] = { "to", 2, FIELD_TO },
+};
+
+static const unsigned char asso[128] = {
+	['b'] = 14, ['c'] = 9, ['d'] = 2, ['e'] = 2, ['f'] = 13, ['h'] = 14,
+	['l'] = 12, ['m'] = 11, ['o'] = 12, ['r'] = 9, ['s'] = 2, ['t'] = 0,
+};
+
+static int header_max;
+
+/* The FETCH item for the headers filter() can use */
+static void header_item(char *item, int len)
+{
+	unsigned mask = rule_fields() | (1 << FIELD_FROM) | (1 << FIELD_SUBJECT);
+	int i, n = snprintf(item, len, "BODY.PEEK[HEADER.FIELDS (");
+
+	for (i = 0; i < 16; ++i)
+		if (headers[i].name &&
+			(headers[i].field == FIELD_DATE || (mask & (1 << headers[i].field))))
+			n += snprintf(item + n, len - n, "%s ", headers[i].name);
+	item[n - 1] = ')';
+
+	header_max = get_global_num("header_max");
+	if (header_max > 0)
+		snprintf(item + n, len - n, "]<0.%d>", header_max);
+	else
+		snprintf(item + n, len - n, "]");
+}
+
+/* Returns the field for the header line or -1 if we don't care */
+static int header_field(const char *line)
+{
+	int len = 0;
+
+	while (line[len] != ':')
+		if (!line[len++] || len > 11)
+			return -1;
+	if (len == 0)
+		return -1;
+
+	unsigned first = (line[0] | 0x20) & 0x7f;
+	unsigned last = (line[len - 1] | 0x20) & 0x7f;
+	const struct header *h = &headers[(len + asso[first] + asso[last]) & 15];
+
+	if (h->len == len && strncasecmp(line, h->name, len) == 0)
+		return h->field;
+	return -1;
+}
+
+/* cut is set if header_max cut the header short */
+static const char *filter(int cut)
 {
 	const struct entry *e;
 
@@ -199,39 +391,49 @@ static int filter(void)
 	folder_match = NULL;
 
 	while (fetchline(buff, sizeof(buff))) {
-		if (strncasecmp(buff, "To:", 3) == 0 ||
-			strncasecmp(buff, "Cc:", 3) == 0 ||
-			strncasecmp(buff, "Bcc:", 4) == 0) {
-			if (list_filter(buff, whitelist))
+		/* Every full line ends in \r, a cut one is only partly there */
+		if (cut && buff[strcspn(buff, "\r")] != '\r')
+			continue;
+
+		int field = header_field(buff);
+
+		switch (field) {
+		case FIELD_TO:
+			match_line(field, buff, hits);
+			if (list_filter(WHITELIST))
 				flags |= IS_HAM;
-			if ((e = list_filter(buff, folderlist)))
+			if ((e = list_filter(FOLDERLIST)))
 				folder_match = e->folder;
-		} else if (strncasecmp(buff, "From:", 5) == 0) {
+			break;
+		case FIELD_FROM:
 			flags |= SAW_FROM;
-			filter_from(buff);
-			if ((e = list_filter(buff, folderlist)))
+			filter_from(field, buff);
+			if ((e = list_filter(FOLDERLIST)))
 				folder_match = e->folder;
-		} else if (strncasecmp(buff, "Subject:", 8) == 0) {
+			break;
+		case FIELD_SUBJECT:
 			normalize_subject(buff);
-			if ((e = list_filter(buff, blacklist)))
+			match_line(field, buff, hits);
+			if ((e = list_filter(BLACKLIST)))
 				flags |= IS_SPAM;
-			else if ((e = list_filter(buff, folderlist)))
+			else if ((e = list_filter(FOLDERLIST)))
 				folder_match = e->folder;
-		} else if (strncasecmp(buff, "Date:", 5) == 0)
+			break;
+		case FIELD_DATE:
 			flags |= SAW_DATE;
-		else if (strncasecmp(buff, "List-Post:", 10) == 0 ||
-				 strncasecmp(buff, "Reply-To:", 9) == 0) {
-			if ((e = list_filter(buff, folderlist)))
+			break;
+		case FIELD_LIST:
+		case FIELD_REPLY_TO:
+			match_line(field, buff, hits);
+			if ((e = list_filter(FOLDERLIST)))
 				folder_match = e->folder;
-		} else if (strncasecmp(buff, "Return-Path:", 12) == 0) {
-			filter_from(buff);
+			break;
+		case FIELD_RETURN_PATH:
+			filter_from(field, buff);
+			break;
 		}
 	}
 
-	if (diary)
-		if (find_diary(cur_uid))
-			logit('D', subject, cur_uid);
-
 	if (flags & IS_IGNORED) {
 		action = 'I';
 		return ignore();
@@ -243,7 +445,7 @@ static int filter(void)
 	}
 
 	if ((flags & IS_SPAM) ||
-		(flags & SAW_FROM) == 0 || (flags & SAW_DATE) == 0) {
+		(!cut && ((flags & SAW_FROM) == 0 || (flags & SAW_DATE) == 0))) {
 		action = 'S';
 		return spam();
 	}
@@ -252,6 +454,100 @@ static int filter(void)
 	return ham();
 }
 
+/* Called by fetch_headers() for each message */
+static void filter_one(unsigned uid, size_t len)
+{
+	if (n_decisions >= MAX_UIDS)
+		return;
+
+	struct decision *d = &decisions[n_decisions++];
+	d->uid = uid;
+	d->path = filter(header_max > 0 && len >= header_max);
+	d->action = action;
+	strcpy(d->subject, subject);
+}
+
+/* The diary needs the messages before they move. The moves are
+ * grouped by folder, one set of commands per folder, and queued to go
+ * out with the next fetch.
+ */
+static int act_on_decisions(unsigned first)
+{
+	static unsigned uids[MAX_UIDS];
+	struct decision *d;
+	int i, j, n;
+
+	if (diary)
+		for (i = 0; i < n_decisions; ++i)
+			if (find_diary(decisions[i].uid))
+				logit('D', decisions[i].subject, decisions[i].uid);
+
+	for (i = 0; i < n_decisions; ++i) {
+		const char *path = decisions[i].path;
+		if (!path)
+			continue;
+
+		for (n = 0, j = i; j < n_decisions; ++j) {
+			d = &decisions[j];
+			if (d->path && strcmp(d->path, path) == 0) {
+				uids[n++] = d->uid;
+				d->path = NULL;
+			}
+		}
+
+		if (dry_run)
+			printf("Move %d to %s\n", n, path);
+		else if (move_uids(path, uids, n, first))
+			return -1;
+	}
+
+	for (i = 0; i < n_decisions; ++i) {
+		d = &decisions[i];
+		if (dry_run)
+			printf("Action %c\n", d->action);
+		logit(d->action, d->subject, d->uid);
+	}
+
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set_batch_size(int n, double elapsed, size_t bytes)
+{
+	if (n == 0)
+		return;
+
+	double per = (elapsed - rtt) / n;
+	if (per < 1e-6)
+		per = 1e-6;
+	msg_time = (msg_time * 3 + per) / 4;
+	msg_bytes = (msg_bytes * 3 + (double)bytes / n) / 4;
+
+	double size = BATCH_RTTS * rtt / msg_time;
+	if (size > BATCH_BYTES / msg_bytes)
+		size = BATCH_BYTES / msg_bytes;
+	/* Do not grow too fast on one good batch */
+	if (size > batch_size * 2)
+		size = batch_size * 2;
+
+	if (size < 1)
+		batch_size = 1;
+	else if (size > MAX_UIDS)
+		batch_size = MAX_UIDS;
+	else
+		batch_size = size;
+
+	if (verbose)
+		printf("Batch %d: rtt %.1fms %.2fms/msg %.0f bytes/msg\n",
+			   batch_size, rtt * 1000, msg_time * 1000, msg_bytes);
+}
+
 static void read_last_seen(void)
 {
 	char path[100], buf[32];
@@ -342,9 +638,11 @@ static int build_list(void)
 again:
 	n_uids = 0;
 
+	double start = now();
 	if (send_recv("UID SEARCH UID %u:*", last_seen)) {
 		return -1;
 	}
+	rtt = rtt ? (rtt * 7 + now() - start) / 8 : now() - start;
 
 	/* For some reason if we get "* 1 RECENT" we don't get the
 	 * UIDs. Search again and we do.
@@ -366,39 +664,94 @@ again:
 	return n_uids;
 }
 
+/* After a batch fetch fails, fetch the messages not yet filtered one
+ * at a time so one bad message cannot lose the batch. Returns -1 if
+ * the connection failed.
+ */
+static int fetch_each(const unsigned *uids, int n, const char *item)
+{
+	for (int i = 0; i < n; ++i) {
+		int j;
+
+		for (j = 0; j < n_decisions && decisions[j].uid != uids[i]; ++j) ;
+		if (j < n_decisions)
+			continue;
+
+		unsigned tag = fetch_queue(uids[i], uids[i], item, filter_one);
+		switch (tag ? imap_wait(tag) : -1) {
+		case 0:
+			break;
+		case 1:
+			logmsg(LOG_WARNING, "Fetch %u failed", uids[i]);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int process_list(void)
 {
 	int did_something = 0;
 	did_delete = 0;
 
+	char item[160];
+	header_item(item, sizeof(item));
+
 	do {
+		/* Redo from the first batch with a failed move. The moves
+		 * still queued when the connection dropped fail on reconnect.
+		 */
+		if (failed_uid) {
+			if (failed_uid < last_seen)
+				last_seen = failed_uid;
+			failed_uid = 0;
+		}
+
 		if (build_list() < 0)
 			return -1;
 
-		for (int i = 0; i < n_uids; ++i) {
-			cur_uid = uidlist[i];
+		for (int i = 0, n; i < n_uids; i += n) {
+			n = n_uids - i < batch_size ? n_uids - i : batch_size;
+			unsigned first = uidlist[i], last = uidlist[i + n - 1];
+
 			if (verbose)
-				printf("Fetch %u\n", cur_uid);
+				printf("Fetch %u:%u\n", first, last);
 
-			switch(fetch(cur_uid)) {
+			n_decisions = 0;
+			double start = now();
+			size_t bytes = imap_bytes;
+			unsigned tag = fetch_queue(first, last, item, filter_one);
+			switch (tag ? imap_wait(tag) : -1) {
 			case 0:
-				if (filter())
+				set_batch_size(n_decisions, now() - start, imap_bytes - bytes);
+				if (act_on_decisions(first))
 					return -1;
-				logit(action, subject, cur_uid);
 				break;
 			case 1:
+				logmsg(LOG_WARNING, "Fetch %u:%u failed", first, last);
+				if (fetch_each(uidlist + i, n, item) || act_on_decisions(first))
+					return -1;
 				break;
 			default:
 				return -1;
 			}
 
-			last_seen = cur_uid + 1;
-			++did_something;
+			last_seen = last + 1;
+			did_something += n;
 		}
+
+		/* Let the last moves finish */
+		if (imap_wait(0) < 0 || failed_uid)
+			return -1;
 	} while (n_uids);
 
-	if (did_something)
+	if (did_something) {
 		write_last_seen();
+		reorder_lists();
+	}
 
 	if (did_delete)
 		send_recv("EXPUNGE"); // mmmm... sponge...
@@ -505,21 +858,22 @@ static void set_user(const char *user)
 
 static void usage(void)
 {
-	puts("usage:\trtf [-dehnvC] [-{lL} logfile] [-u user]\n"
+	puts("usage:\trtf [-dehnvCS] [-{lL} logfile] [-u user]\n"
 		 "where:\t-d   daemonize\n"
 		 "\t-e   use stderr\n"
 		 "\t-h   this help\n"
 		 "\t-n   dry run\n"
 		 "\t-v   more verbose\n"
 		 "\t-C   just check the config file\n"
+		 "\t-S   dump the rule stats by cost\n"
 		 "-l only logs messages that match a rule, -L logs everything."
 		);
 }
 
 int main(int argc, char *argv[])
 {
-	int c, rc, do_daemon = 0;
-	while ((c = getopt(argc, argv, "dehl:nu:vC")) != EOF)
+	int c, rc, do_daemon = 0, dump_stats = 0;
+	while ((c = getopt(argc, argv, "dehl:nu:vCS")) != EOF)
 		switch (c) {
 		case 'd': do_daemon = 1; break;
 		case 'e': ++use_stderr; break;
@@ -530,6 +884,7 @@ int main(int argc, char *argv[])
 		case 'u': set_user(optarg); break;
 		case 'v': ++verbose; break;
 		case 'C': just_checking = 1; use_stderr = 1; break;
+		case 'S': dump_stats = 1; break;
 		}
 
 	rc = read_config();
@@ -537,9 +892,16 @@ int main(int argc, char *argv[])
 		return rc;
 	if (just_checking)
 		return check_folders();
+	if (dump_stats) {
+		stats_dump();
+		return 0;
+	}
 
 	signal(SIGUSR1, need_reread);
 
+	if (logfile && !dry_run)
+		eventlog_open(logfile);
+
 	read_last_seen();
 
 	// Log the start
@@ -2,6 +2,7 @@
 
 #include <poll.h>
 #include <dirent.h>
+#include <sys/wait.h>
 #ifdef __linux__
 #include <sys/inotify.h>
 #else
@@ -36,6 +37,7 @@ static char ham_dir[MY_PATH_MAX];
 static char spam_dir[MY_PATH_MAX];
 static char ignore_dir[MY_PATH_MAX];
 static char config_dir[MY_PATH_MAX];
+static const char *home;
 static char *logfile;
 static int run_bogo;
 
@@ -46,37 +48,19 @@ static void logit(const char *tmp_file, char flag)
 	if (!logfile)
 		return;
 
-	FILE *fp = fopen(logfile, "a");
-	if (!fp) {
-		syslog(LOG_ERR, "%s: %m", logfile);
-		return;
-	}
-
-	if (flock(fileno(fp), LOCK_EX)) {
-		syslog(LOG_ERR, "%s: flock: %m", logfile);
-		fclose(fp);
-		return;
-	}
-	
 	/* Remove special chars from tmp_file to match rtf */
 	char tmp[24], *p;
 	snprintf(tmp, sizeof(tmp), "%s", tmp_file);
 	if ((p = strchr(tmp, ':'))) *p = 0;
 
 	/* Last two flags are for learnem */
-	fprintf(fp, "%-20s --------L%c\n", tmp, flag);
-
-	if (ferror(fp))
-		syslog(LOG_ERR, "%s: write error", logfile);
-
-	fclose(fp);
+	char rec[64];
+	int len = snprintf(rec, sizeof(rec), "%-20s --------L%c\n", tmp, flag);
+	eventlog_write(rec, len);
 }
 
 static void do_bogofilter(const char *old, int spam)
 {
-	if (!run_bogo)
-		return;
-
 	char cmd[512];
 
 	snprintf(cmd, sizeof(cmd), "/usr/bin/bogofilter %s -d %s -B -e '%s'",
@@ -86,61 +70,174 @@ static void do_bogofilter(const char *old, int spam)
 		syslog(LOG_ERR, "bogofilter failed on %s!", old);
 }
 
-static void handle_spam(void)
+/* Files per bogofilter -b run */
+#define BOGO_CHUNK 64
+
+/* Feed a chunk of files to one bogofilter in bulk mode. Returns -1 if
+ * bogofilter could not be run at all, so nothing was registered.
+ */
+static int bogofilter_chunk(const char *dname, char **names, int n, int spam)
 {
-	DIR *dir = opendir(learn_dir);
-	if (!dir) {
-		syslog(LOG_ERR, "opendir %s: %s", learn_dir, strerror(errno));
+	int status;
+
+	/* Use a file for the list so the pipe cannot fill up */
+	FILE *list = tmpfile();
+	if (!list)
+		return -1;
+
+	for (int i = 0; i < n; ++i)
+		fprintf(list, "%s/%s\n", dname, names[i]);
+	if (fflush(list) || lseek(fileno(list), 0, SEEK_SET)) {
+		fclose(list);
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(fileno(list), 0);
+		execl("/usr/bin/bogofilter", "bogofilter", spam ? "-Ns" : "-Sn",
+			  "-d", config_dir, "-b", "-e", NULL);
+		_exit(127);
+	}
+	fclose(list);
+	if (pid < 0 || waitpid(pid, &status, 0) < 0)
+		return -1;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+		return -1;
+
+	/* bogofilter says nothing per file when registering, so we cannot
+	 * tell which ones it got. Redoing them could count some twice, so
+	 * just report them all.
+	 */
+	if (!WIFEXITED(status) || WEXITSTATUS(status) > 2)
+		for (int i = 0; i < n; ++i)
+			syslog(LOG_ERR, "bogofilter failed on %s/%s!", dname, names[i]);
+	return 0;
+}
+
+static void bogofilter_files(const char *dname, char **names, int n, int spam)
+{
+	for (int i = 0; i < n; i += BOGO_CHUNK) {
+		int len = n - i < BOGO_CHUNK ? n - i : BOGO_CHUNK;
+
+		if (bogofilter_chunk(dname, names + i, len, spam) == 0)
+			continue;
+
+		/* Nothing was registered, so try them one at a time */
+		syslog(LOG_WARNING, "bogofilter -b could not run");
+		for (int j = i; j < i + len; ++j) {
+			char path[MY_PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", dname, names[j]);
+			do_bogofilter(path, spam);
+		}
+	}
+}
+
+/* Like rtf, use the built in db if there is one. rtf registered the
+ * message as the other class, so take it out of that one.
+ */
+static void train_files(const char *dname, char **names, int n, int spam)
+{
+	if (!run_bogo)
+		return;
+
+	if (bayes_open(home)) {
+		bogofilter_files(dname, names, n, spam);
 		return;
 	}
 
+	for (int i = 0; i < n; ++i) {
+		char path[MY_PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", dname, names[i]);
+		if (bayes_unregister(path, !spam) || bayes_register(path, spam))
+			syslog(LOG_ERR, "bayes failed on %s!", path);
+	}
+}
+
+/* Returns the names in the directory. The caller frees them. */
+static int read_dir(const char *dname, char ***names)
+{
+	int n = 0, max = 0;
+
+	*names = NULL;
+
+	DIR *dir = opendir(dname);
+	if (!dir) {
+		syslog(LOG_ERR, "opendir %s: %s", dname, strerror(errno));
+		return 0;
+	}
+
 	struct dirent *ent;
 	while ((ent = readdir(dir))) {
 		if (*ent->d_name == '.') continue;
 
+		if (n >= max) {
+			max += 64;
+			char **new = realloc(*names, max * sizeof(char *));
+			if (!new) {
+				syslog(LOG_ERR, "%s: out of memory", dname);
+				break;
+			}
+			*names = new;
+		}
+		if (((*names)[n] = strdup(ent->d_name)))
+			++n;
+	}
+
+	closedir(dir);
+
+	return n;
+}
+
+static void handle_spam(void)
+{
+	char **names;
+	int n = read_dir(learn_dir, &names);
+
+	train_files(learn_dir, names, n, 1);
+
+	for (int i = 0; i < n; ++i) {
 		char old[MY_PATH_MAX], new[MY_PATH_MAX], *p;
-		snprintf(old, sizeof(old), "%s/%s", learn_dir, ent->d_name);
-		do_bogofilter(old, 1);
+		snprintf(old, sizeof(old), "%s/%s", learn_dir, names[i]);
 
 		/* Move to spam and mark read */
-		p = ent->d_name + strlen(ent->d_name) - 1;
+		p = names[i] + strlen(names[i]) - 1;
 		if (*p == ',')
-			snprintf(new, sizeof(new) - 3, "%s/%sS", spam_dir, ent->d_name);
+			snprintf(new, sizeof(new) - 3, "%s/%sS", spam_dir, names[i]);
 		else
-			snprintf(new, sizeof(new) - 3, "%s/%s,S", spam_dir, ent->d_name);
+			snprintf(new, sizeof(new) - 3, "%s/%s,S", spam_dir, names[i]);
 		if (rename(old, new))
 			syslog(LOG_ERR, "rename(%s, %s) failed", old, new);
 		else
-			logit(ent->d_name, 'S');
+			logit(names[i], 'S');
+
+		free(names[i]);
 	}
 
-	closedir(dir);
+	free(names);
 }
 
 static void handle_ham(void)
 {
-	DIR *dir = opendir(ham_dir);
-	if (!dir) {
-		syslog(LOG_ERR, "opendir %s: %s", ham_dir, strerror(errno));
-		return;
-	}
+	char **names;
+	int n = read_dir(ham_dir, &names);
 
-	struct dirent *ent;
-	while ((ent = readdir(dir))) {
-		if (*ent->d_name == '.') continue;
+	train_files(ham_dir, names, n, 0);
 
+	for (int i = 0; i < n; ++i) {
 		char old[MY_PATH_MAX];
-		snprintf(old, sizeof(old), "%s/%s", ham_dir, ent->d_name);
-		do_bogofilter(old, 0);
+		snprintf(old, sizeof(old), "%s/%s", ham_dir, names[i]);
 
 		/* Just remove it */
 		if (unlink(old))
 			syslog(LOG_ERR, "unlink %s: %s", old, strerror(errno));
 		else
-			logit(ent->d_name, 'H');
+			logit(names[i], 'H');
+
+		free(names[i]);
 	}
 
-	closedir(dir);
+	free(names);
 }
 
 static int cleanup_dir(const char *dname)
@@ -248,7 +345,7 @@ int main(int argc, char *argv[])
 {
 	int do_delete = 0, foreground = 0;
 
-	char *home = getenv("HOME");
+	home = getenv("HOME");
 	if (!home) {
 		syslog(LOG_ERR, "You are homeless.");
 		exit(1);
@@ -264,6 +361,9 @@ int main(int argc, char *argv[])
 		default: puts("Sorry!"); exit(1);
 		}
 
+	if (logfile)
+		eventlog_open(logfile);
+
 	snprintf(config_dir, sizeof(config_dir), "%s/.bogofilter", home);
 	snprintf(spam_dir, sizeof(spam_dir), "%s/Maildir/%s/cur", home, SPAM_DIR);
 	snprintf(learn_dir, sizeof(learn_dir), "%s/Maildir/%s/cur", home, LEARN_DIR);
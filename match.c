@@ -0,0 +1,695 @@
+/* match.c - case insensitive multi-pattern matching
+ *
+ * The filter lists are compiled into one Aho-Corasick automaton so a
+ * header line is scanned once no matter how many entries there
+ * are. Every pattern carries an id supplied by the caller and the
+ * scan calls back with the id of every pattern found in the line. It
+ * is up to the caller to map the ids back to list entries and decide
+ * which hit wins.
+ *
+ * The compiled automaton is just flat arrays of integers. The root
+ * gets a full 256 entry transition table since most lookups end up
+ * there. All other states have a sorted list of edges.
+ */
+
+#include "rtf.h"
+#include <stdint.h>
+
+/* Build time trie node. Children are kept sorted by ch. */
+struct node {
+	uint32_t child;
+	uint32_t sibling;
+	uint32_t out;
+	uint8_t ch;
+};
+
+struct ac_state {
+	uint32_t edge;		/* first edge in edges[] */
+	uint32_t n_edges;
+	uint32_t fail;
+	uint32_t out;		/* first output in outs[], 0 for none */
+};
+
+struct ac_edge {
+	uint32_t ch;
+	uint32_t next;
+};
+
+/* Outputs are chained. A state's chain ends with the chain of its
+ * fail state so a single walk reports every pattern ending here.
+ */
+struct ac_out {
+	uint32_t id;
+	uint32_t next;
+};
+
+struct matcher {
+	/* build time */
+	struct node *nodes;
+	unsigned n_nodes, max_nodes;
+
+	/* out[0] is unused so 0 can mean none */
+	struct ac_out *outs;
+	unsigned n_outs, max_outs;
+
+	/* compiled */
+	struct ac_state *states;
+	struct ac_edge *edges;
+	unsigned n_states, n_edges;
+	uint32_t root_out; /* empty patterns always match */
+	uint32_t root[256];
+
+	int mapped; /* arrays point into a matcher_map() buffer */
+};
+
+/* The saved form is this header followed by the states, edges, and
+ * outputs arrays.
+ */
+struct matcher_image {
+	uint32_t n_states, n_edges, n_outs;
+	uint32_t root_out;
+	uint32_t root[256];
+};
+
+static unsigned char fold[256];
+
+static void init_fold(void)
+{
+	if (fold['A'] == 'a')
+		return;
+
+	for (int i = 0; i < 256; ++i)
+		fold[i] = tolower(i);
+}
+
+static int grow(void **array, unsigned *max, unsigned need, size_t size)
+{
+	if (need < *max)
+		return 0;
+
+	unsigned new_max = *max ? *max * 2 : 64;
+	void *new = realloc(*array, new_max * size);
+	if (!new)
+		return -1;
+
+	*array = new;
+	*max = new_max;
+	return 0;
+}
+
+struct matcher *matcher_new(void)
+{
+	init_fold();
+
+	struct matcher *m = calloc(1, sizeof(struct matcher));
+	if (!m)
+		return NULL;
+
+	/* root node and the unused output */
+	if (grow((void **)&m->nodes, &m->max_nodes, 1, sizeof(struct node)) ||
+		grow((void **)&m->outs, &m->max_outs, 1, sizeof(struct ac_out))) {
+		matcher_free(m);
+		return NULL;
+	}
+	memset(m->nodes, 0, sizeof(struct node));
+	m->n_nodes = 1;
+	m->n_outs = 1;
+
+	return m;
+}
+
+void matcher_free(struct matcher *m)
+{
+	if (m && m->mapped)
+		free(m);
+	else if (m) {
+		free(m->nodes);
+		free(m->outs);
+		free(m->states);
+		free(m->edges);
+		free(m);
+	}
+}
+
+static int add_child(struct matcher *m, uint32_t parent, uint8_t ch)
+{
+	uint32_t *link = &m->nodes[parent].child;
+
+	while (*link && m->nodes[*link].ch < ch)
+		link = &m->nodes[*link].sibling;
+	if (*link && m->nodes[*link].ch == ch)
+		return *link;
+
+	if (grow((void **)&m->nodes, &m->max_nodes, m->n_nodes, sizeof(struct node)))
+		return -1;
+	/* nodes may have moved */
+	link = &m->nodes[parent].child;
+	while (*link && m->nodes[*link].ch < ch)
+		link = &m->nodes[*link].sibling;
+
+	uint32_t new = m->n_nodes++;
+	m->nodes[new].ch = ch;
+	m->nodes[new].child = 0;
+	m->nodes[new].out = 0;
+	m->nodes[new].sibling = *link;
+	*link = new;
+	return new;
+}
+
+/* Must be called before matcher_compile(). */
+int matcher_add(struct matcher *m, const char *str, unsigned id)
+{
+	int node = 0;
+
+	for (const unsigned char *p = (const unsigned char *)str; *p; ++p)
+		if ((node = add_child(m, node, fold[*p])) < 0)
+			return -1;
+
+	if (grow((void **)&m->outs, &m->max_outs, m->n_outs, sizeof(struct ac_out)))
+		return -1;
+
+	uint32_t out = m->n_outs++;
+	m->outs[out].id = id;
+	m->outs[out].next = m->nodes[node].out;
+	m->nodes[node].out = out;
+	return 0;
+}
+
+static inline uint32_t next_state(const struct matcher *m, uint32_t s, unsigned ch)
+{
+	const struct ac_state *state = &m->states[s];
+	const struct ac_edge *e = &m->edges[state->edge];
+	unsigned lo = 0, hi = state->n_edges;
+
+	if (hi <= 8) {
+		for (; lo < hi; ++lo)
+			if (e[lo].ch == ch)
+				return e[lo].next;
+		return 0;
+	}
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (e[mid].ch == ch)
+			return e[mid].next;
+		if (e[mid].ch < ch)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+/* Converts the trie into the flat automaton. The states are numbered
+ * breadth first so the fail state of a state is always already
+ * finished when we get to it.
+ */
+int matcher_compile(struct matcher *m)
+{
+	unsigned n = m->n_nodes;
+	uint32_t *order = malloc(n * sizeof(uint32_t));
+	uint8_t *chars = malloc(n);
+	uint32_t *parent = malloc(n * sizeof(uint32_t));
+
+	m->states = calloc(n, sizeof(struct ac_state));
+	m->edges = calloc(n, sizeof(struct ac_edge));
+	if (!order || !chars || !parent || !m->states || !m->edges) {
+		free(order);
+		free(chars);
+		free(parent);
+		return -1;
+	}
+
+	/* Breadth first walk. order[] holds the trie node for each state. */
+	unsigned head = 0, tail = 1;
+	order[0] = 0;
+	parent[0] = 0;
+	while (head < tail) {
+		uint32_t s = head++;
+		m->states[s].edge = m->n_edges;
+		for (uint32_t c = m->nodes[order[s]].child; c; c = m->nodes[c].sibling) {
+			m->edges[m->n_edges].ch = m->nodes[c].ch;
+			m->edges[m->n_edges].next = tail;
+			++m->n_edges;
+			++m->states[s].n_edges;
+			chars[tail] = m->nodes[c].ch;
+			parent[tail] = s;
+			order[tail++] = c;
+		}
+	}
+	m->n_states = tail;
+
+	memset(m->root, 0, sizeof(m->root));
+	for (unsigned i = 0; i < m->states[0].n_edges; ++i)
+		m->root[m->edges[i].ch] = m->edges[i].next;
+
+	m->root_out = m->nodes[0].out;
+	for (uint32_t s = 1; s < m->n_states; ++s) {
+		struct ac_state *state = &m->states[s];
+		uint32_t p = parent[s], fail = 0;
+
+		if (p) {
+			uint32_t f = m->states[p].fail;
+			while (f && !(fail = next_state(m, f, chars[s])))
+				f = m->states[f].fail;
+			if (!f)
+				fail = m->root[chars[s]];
+		}
+		state->fail = fail;
+
+		/* Our own outputs followed by the fail state's chain */
+		state->out = m->nodes[order[s]].out;
+		if (state->out) {
+			uint32_t o = state->out;
+			while (m->outs[o].next)
+				o = m->outs[o].next;
+			m->outs[o].next = m->states[fail].out;
+		} else
+			state->out = m->states[fail].out;
+	}
+
+	free(order);
+	free(chars);
+	free(parent);
+
+	free(m->nodes);
+	m->nodes = NULL;
+	m->n_nodes = m->max_nodes = 0;
+
+	return 0;
+}
+
+/* Returns the number of bytes written or -1 on error. Always a
+ * multiple of 4 bytes.
+ */
+long matcher_write(const struct matcher *m, FILE *fp)
+{
+	struct matcher_image image = {
+		.n_states = m->n_states,
+		.n_edges = m->n_edges,
+		.n_outs = m->n_outs,
+		.root_out = m->root_out,
+	};
+	memcpy(image.root, m->root, sizeof(image.root));
+
+	if (fwrite(&image, sizeof(image), 1, fp) != 1 ||
+		fwrite(m->states, sizeof(struct ac_state), m->n_states, fp) != m->n_states ||
+		fwrite(m->edges, sizeof(struct ac_edge), m->n_edges, fp) != m->n_edges ||
+		fwrite(m->outs, sizeof(struct ac_out), m->n_outs, fp) != m->n_outs)
+		return -1;
+
+	return sizeof(image) + m->n_states * sizeof(struct ac_state) +
+		m->n_edges * sizeof(struct ac_edge) + m->n_outs * sizeof(struct ac_out);
+}
+
+/* Checks that every index in the image stays in its array, so a
+ * corrupt image cannot send matcher_scan() off the end. The fail
+ * states must come first, as they do breadth first, so the fail walk
+ * always ends. The ids must be less than n_ids.
+ */
+static int image_ok(const struct matcher_image *image, unsigned n_ids)
+{
+	const struct ac_state *states = (const struct ac_state *)(image + 1);
+	const struct ac_edge *edges = (const struct ac_edge *)(states + image->n_states);
+	const struct ac_out *outs = (const struct ac_out *)(edges + image->n_edges);
+	uint32_t i;
+
+	if (image->n_states == 0 || image->n_outs == 0 || image->root_out >= image->n_outs)
+		return 0;
+	for (i = 0; i < 256; ++i)
+		if (image->root[i] >= image->n_states)
+			return 0;
+	for (i = 0; i < image->n_states; ++i)
+		if ((uint64_t)states[i].edge + states[i].n_edges > image->n_edges ||
+			(i && states[i].fail >= i) || states[i].out >= image->n_outs)
+			return 0;
+	for (i = 0; i < image->n_edges; ++i)
+		if (edges[i].next >= image->n_states)
+			return 0;
+	for (i = 1; i < image->n_outs; ++i)
+		if (outs[i].id >= n_ids || outs[i].next >= image->n_outs)
+			return 0;
+	return 1;
+}
+
+/* Creates a matcher that uses the saved image in buf directly. buf
+ * must stay mapped for the life of the matcher. Returns NULL if the
+ * image is corrupt.
+ */
+struct matcher *matcher_map(const void *buf, size_t len, unsigned n_ids)
+{
+	const struct matcher_image *image = buf;
+
+	if (len < sizeof(*image) ||
+		len != sizeof(*image) + (size_t)image->n_states * sizeof(struct ac_state) +
+		(size_t)image->n_edges * sizeof(struct ac_edge) +
+		(size_t)image->n_outs * sizeof(struct ac_out) ||
+		!image_ok(image, n_ids))
+		return NULL;
+
+	init_fold();
+
+	struct matcher *m = calloc(1, sizeof(struct matcher));
+	if (!m)
+		return NULL;
+
+	m->mapped = 1;
+	m->n_states = image->n_states;
+	m->n_edges = image->n_edges;
+	m->n_outs = image->n_outs;
+	m->root_out = image->root_out;
+	memcpy(m->root, image->root, sizeof(m->root));
+	m->states = (struct ac_state *)(image + 1);
+	m->edges = (struct ac_edge *)(m->states + m->n_states);
+	m->outs = (struct ac_out *)(m->edges + m->n_edges);
+	return m;
+}
+
+void matcher_scan(const struct matcher *m, const char *str, match_fn hit, void *arg)
+{
+	uint32_t s = 0, o;
+
+	for (o = m->root_out; o; o = m->outs[o].next)
+		hit(m->outs[o].id, arg);
+
+	for (const unsigned char *p = (const unsigned char *)str; *p; ++p) {
+		unsigned ch = fold[*p];
+		uint32_t t;
+
+		while (s) {
+			if ((t = next_state(m, s, ch))) {
+				s = t;
+				goto found;
+			}
+			s = m->states[s].fail;
+		}
+		s = m->root[ch];
+
+	found:
+		for (o = m->states[s].out; o; o = m->outs[o].next)
+			hit(m->outs[o].id, arg);
+	}
+}
+
+/* Case insensitive substring search
+ *
+ * glibc's strcasestr() works a byte at a time. Here we look for the
+ * first and last characters of the needle 16 (SSE2) or 32 (AVX2)
+ * bytes at a time and only compare the whole needle at the candidate
+ * positions. Folding is only ASCII, which is all strcasestr() does in
+ * the C locale anyway. Letters are matched by or'ing in 0x20, which
+ * only maps the upper and lower case forms of a letter together.
+ */
+
+struct needle {
+	const char *str;
+	size_t len;
+	uint8_t first, first_mask;
+	uint8_t last, last_mask;
+};
+
+static void needle_init(struct needle *n, const char *str, size_t len)
+{
+	uint8_t first = str[0], last = str[len - 1];
+
+	n->str = str;
+	n->len = len;
+	n->first_mask = isalpha(first) ? 0x20 : 0;
+	n->first = first | n->first_mask;
+	n->last_mask = isalpha(last) ? 0x20 : 0;
+	n->last = last | n->last_mask;
+}
+
+static const char *scalar_casestr(const char *h, size_t start, size_t hlen,
+								  const struct needle *n)
+{
+	for (size_t i = start; i + n->len <= hlen; ++i)
+		if ((uint8_t)(h[i] | n->first_mask) == n->first &&
+			strncasecmp(h + i, n->str, n->len) == 0)
+			return h + i;
+	return NULL;
+}
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+
+#define CHECK_CANDIDATES(bits)									\
+	while (bits) {												\
+		int bit = __builtin_ctz(bits);							\
+		if (strncasecmp(h + i + bit, n->str, n->len) == 0)		\
+			return h + i + bit;									\
+		bits &= bits - 1;										\
+	}
+
+static const char *sse2_casestr(const char *h, size_t hlen, const struct needle *n)
+{
+	const __m128i first = _mm_set1_epi8(n->first);
+	const __m128i first_mask = _mm_set1_epi8(n->first_mask);
+	const __m128i last = _mm_set1_epi8(n->last);
+	const __m128i last_mask = _mm_set1_epi8(n->last_mask);
+	size_t i;
+
+	for (i = 0; i + n->len - 1 + 16 <= hlen; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(h + i + n->len - 1));
+		a = _mm_cmpeq_epi8(_mm_or_si128(a, first_mask), first);
+		b = _mm_cmpeq_epi8(_mm_or_si128(b, last_mask), last);
+		unsigned bits = _mm_movemask_epi8(_mm_and_si128(a, b));
+		CHECK_CANDIDATES(bits);
+	}
+
+	return scalar_casestr(h, i, hlen, n);
+}
+
+__attribute__((target("avx2")))
+static const char *avx2_casestr(const char *h, size_t hlen, const struct needle *n)
+{
+	const __m256i first = _mm256_set1_epi8(n->first);
+	const __m256i first_mask = _mm256_set1_epi8(n->first_mask);
+	const __m256i last = _mm256_set1_epi8(n->last);
+	const __m256i last_mask = _mm256_set1_epi8(n->last_mask);
+	size_t i;
+
+	for (i = 0; i + n->len - 1 + 32 <= hlen; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(h + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(h + i + n->len - 1));
+		a = _mm256_cmpeq_epi8(_mm256_or_si256(a, first_mask), first);
+		b = _mm256_cmpeq_epi8(_mm256_or_si256(b, last_mask), last);
+		unsigned bits = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+		CHECK_CANDIDATES(bits);
+	}
+
+	return scalar_casestr(h, i, hlen, n);
+}
+
+static const char *pick_casestr(const char *h, size_t hlen, const struct needle *n);
+
+static const char *(*casestr)(const char *h, size_t hlen,
+							  const struct needle *n) = pick_casestr;
+
+static const char *pick_casestr(const char *h, size_t hlen, const struct needle *n)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		casestr = avx2_casestr;
+	else
+		casestr = sse2_casestr;
+	return casestr(h, hlen, n);
+}
+#else
+static const char *casestr(const char *h, size_t hlen, const struct needle *n)
+{
+	return scalar_casestr(h, 0, hlen, n);
+}
+#endif
+
+/* Drop in replacement for strcasestr() */
+char *fast_strcasestr(const char *haystack, const char *needle)
+{
+	struct needle n;
+	size_t nlen = strlen(needle);
+
+	if (nlen == 0)
+		return (char *)haystack;
+
+	size_t hlen = strlen(haystack);
+	if (nlen > hlen)
+		return NULL;
+
+	needle_init(&n, needle, nlen);
+	return (char *)casestr(haystack, hlen, &n);
+}
+
+/* Required literals for regular expressions
+ *
+ * We walk the extended regular expression and find a set of literal
+ * strings such that any line the expression matches must contain at
+ * least one of them. Usually it is a single string, an alternation
+ * gives one string per branch. The longest shortest string wins. If
+ * we are not sure about something we give up on that piece, so the
+ * worst case is the expression always gets run.
+ */
+
+struct literals {
+	int n;
+	char str[MAX_LITERALS][MAX_LITERAL_LEN];
+};
+
+static int score(const struct literals *l)
+{
+	int min = l->n ? MAX_LITERAL_LEN : 0;
+
+	for (int i = 0; i < l->n; ++i) {
+		int len = strlen(l->str[i]);
+		if (len < min)
+			min = len;
+	}
+	return min;
+}
+
+static void better(struct literals *best, const struct literals *l)
+{
+	if (score(l) > score(best))
+		*best = *l;
+}
+
+static void flush_run(struct literals *best, char *run, int *len)
+{
+	if (*len) {
+		struct literals l = { .n = 1 };
+		run[*len] = 0;
+		strcpy(l.str[0], run);
+		better(best, &l);
+		*len = 0;
+	}
+}
+
+/* Returns with p pointing after the quantifier. Sets min to the
+ * minimum repeat count.
+ */
+static const char *quantifier(const char *p, int *min)
+{
+	switch (*p) {
+	case '*':
+	case '?':
+		*min = 0;
+		return p + 1;
+	case '+':
+		*min = 1;
+		return p + 1;
+	case '{':
+		*min = strtol(p + 1, NULL, 10);
+		while (*p && *p != '}')
+			++p;
+		return *p ? p + 1 : p;
+	default:
+		*min = -1; /* no quantifier */
+		return p;
+	}
+}
+
+static const char *skip_bracket(const char *p)
+{
+	++p; /* skip [ */
+	if (*p == '^') ++p;
+	if (*p == ']') ++p;
+	while (*p && *p != ']')
+		if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+			char end = p[1];
+			for (p += 2; *p && !(*p == end && p[1] == ']'); ++p) ;
+			if (*p) p += 2;
+		} else
+			++p;
+	return *p ? p + 1 : p;
+}
+
+static const char *parse_alt(const char *p, struct literals *out);
+
+static const char *parse_seq(const char *p, struct literals *best)
+{
+	char run[MAX_LITERAL_LEN];
+	int len = 0, min;
+
+	best->n = 0;
+
+	while (*p && *p != '|' && *p != ')') {
+		int ch = -1;
+		struct literals sub = { .n = 0 };
+
+		switch (*p) {
+		case '(':
+			p = parse_alt(p + 1, &sub);
+			if (*p == ')') ++p;
+			break;
+		case '[':
+			p = skip_bracket(p);
+			break;
+		case '.':
+		case '^':
+		case '$':
+			++p;
+			break;
+		case '\\':
+			/* \< \> \` \' are anchors like \b */
+			if (p[1] && !isalnum((unsigned char)p[1]) && !strchr("<>`'", p[1]))
+				ch = p[1];
+			p += p[1] ? 2 : 1;
+			break;
+		default:
+			ch = *p++;
+		}
+
+		p = quantifier(p, &min);
+
+		if (ch != -1 && min != 0) {
+			if (len < MAX_LITERAL_LEN - 1)
+				run[len++] = ch;
+			if (min > 0) /* repeats end the run */
+				flush_run(best, run, &len);
+		} else {
+			flush_run(best, run, &len);
+			if (min != 0)
+				better(best, &sub);
+		}
+	}
+
+	flush_run(best, run, &len);
+	return p;
+}
+
+static const char *parse_alt(const char *p, struct literals *out)
+{
+	struct literals seq;
+	int ok = 1;
+
+	p = parse_seq(p, out);
+	if (out->n == 0)
+		ok = 0;
+
+	while (*p == '|') {
+		p = parse_seq(p + 1, &seq);
+		if (seq.n == 0 || out->n + seq.n > MAX_LITERALS)
+			ok = 0;
+		else if (ok) {
+			memcpy(out->str[out->n], seq.str, seq.n * MAX_LITERAL_LEN);
+			out->n += seq.n;
+		}
+	}
+
+	if (!ok)
+		out->n = 0;
+	return p;
+}
+
+/* Returns the number of literals found, 0 if there are none. */
+int regex_literals(const char *re, char lits[MAX_LITERALS][MAX_LITERAL_LEN])
+{
+	struct literals l;
+
+	/* A stray ) means we did not understand the expression */
+	if (*parse_alt(re, &l) || score(&l) < MIN_LITERAL_LEN)
+		return 0;
+
+	memcpy(lits, l.str, l.n * MAX_LITERAL_LEN);
+	return l.n;
+}
@@ -34,6 +34,7 @@
  * 4) Check if from me (spam)
  * 5) Check if the from and/or date fields are missing (spam)
  * 6) Optionally runs the emails through bogofilter (ham or spam)
+ *    If there is a ~/.rtf.bayes the built in classifier is used
  * 7) Optionally check if not on the me list (spam)
  * 8) Optionally check if saw application attachment (app)
  *
@@ -58,7 +59,9 @@
  *
  * You can put regular expressions in the list match strings. Regular
  * expressions start with a plus sign (+). All other strings are
- * literal and do not go through the regexp parser.
+ * literal and do not go through the regexp parser. If a regular
+ * expression requires a literal string, e.g. +@spam\.com$, it is only
+ * run on lines that contain the string.
  *
  * Note that you are given the entire header line. This means you can
  * match on the field to differentiate say To: and Cc:.
@@ -67,6 +70,15 @@
  *
  * - mail forwarding
  * - folders
+ * - daemon mode (see run_daemon)
+ *
+ * The [global] section:
+ *
+ * durability=strict - sync the message and the Maildir (default)
+ * durability=group - daemon mode syncs batches of messages, see
+ *                    run_daemon. Same as strict without -D.
+ * durability=none - no syncs, for testing
+ * group_ms=N - how long a group waits for stragglers (default 10)
  */
 
 /* Ideas that failed:
@@ -76,18 +88,31 @@
 
 #include "rtf.h"
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
 #include <regex.h>
 
 #define BOGOFILTER "bogofilter"
 
 static int run_bogo;
 static int train_bogo;
+static int use_bayes;
 static int run_drop;
 static int drop_apps;
 static int forward;
 static int just_checking;
 static const char *logfile;
 static const char *home;
+
+enum { DURABLE_STRICT, DURABLE_GROUP, DURABLE_NONE };
+static int durability;
+static int group_ms = 10;
 /* We only print the first 42 chars of subject */
 static char subject[48] = { 'N', 'O', 'N', 'E' };
 static char action = '?';
@@ -110,7 +135,14 @@ struct entry {
 	const char *str;
 	const char *folder;
 	regex_t *reg;
+	int regex;		/* reg is compiled on first use from the cache */
+	int list;
+	unsigned index;
+	int gated;		/* regex only run if a literal is seen */
+	unsigned seen;
 	struct entry *next;
+	struct entry *next_reg;
+	struct rule_stats *stats;	/* looked up on first use */
 };
 
 static struct entry *melist;
@@ -123,6 +155,32 @@ static struct entry *forwardfilter;
 static struct entry *folderlist;
 static const  char *folder_match;
 
+/* The first N_LISTS lists are matched against header lines. */
+enum { WHITELIST, BLACKLIST, GRAYLIST, MELIST, FROMLIST, FOLDERLIST, N_LISTS,
+	   FORWARDLIST = N_LISTS, FORWARDFILTER, N_ALL_LISTS };
+
+static struct entry **const config_lists[N_ALL_LISTS] = {
+	&whitelist, &blacklist, &graylist, &melist, &fromlist, &folderlist,
+	&forwardlist, &forwardfilter
+};
+
+/* The config section names, used to name the rules in the stats */
+static const char *const list_names[N_LISTS] = {
+	"whitelist", "blacklist", "ignore", "me", "fromlist", "folders"
+};
+
+/* All the literal entries are in the matcher. The regular
+ * expressions are chained per list in list order. The required
+ * literals of the regular expressions are also in the matcher, a hit
+ * just marks the expression as seen for the current line.
+ */
+static struct matcher *matcher;
+static struct entry **match_entries;
+static struct entry *reglist[N_LISTS];
+static struct entry *hits[N_LISTS];
+static unsigned cur_line;
+static struct rule_stats *scan_stats;
+
 static const struct entry *saw_bl[2];
 static int add_blacklist;
 
@@ -138,52 +196,69 @@ static char tmp_file[84], tmp_path[PATH_SIZE];
 #ifdef WANT_FORWARDING
 #include <curl/curl.h>
 
-#define LINE_SIZE 4096
-
+/* The spooled message is mapped. curl gets it from the first "real"
+ * header line with \n turned into \r\n.
+ */
 struct user_data {
-	const char *fname;
-	FILE *fp;
-	int output;
+	const char *base;
+	size_t len;
+	size_t pos;
+	int cr;		/* the \r for the \n at pos has been sent */
 };
 
-static size_t read_callback(char *output, size_t size, size_t nmemb, void *datap)
+/* Returns the offset of the first line we forward */
+static size_t skip_header(const char *base, size_t len)
 {
-	struct user_data *data = datap;
-	int ch;
-	size_t n = 0;
+	size_t pos = 0;
 
-	/* I have always seen size == 1 */
-	if (size == 1)
-		size = nmemb;
-	else
-		size *= nmemb;
-	if (size > 0)
-		--size; /* we need room for possible \r\n */
-
-	if (data->output == 0) {
-		/* We need to find the first "real" header line */
-		while (fgets(output, size, data->fp))
-			if (!isspace(*output) &&
-				strncmp(output, "Received:", 9) &&
-				strncmp(output, "Return-Path:", 12) &&
-				strncmp(output, "Delivered-To:", 13)) {
-				data->output = 1;
-				char *p = strchr(output, '\n');
-				if (p) *p = 0;
-				strcat(output, "\r\n");
-				n = strlen(output);
-				output += n;
-				break;
-			}
+	while (pos < len) {
+		const char *line = base + pos;
+		size_t left = len - pos;
+
+		if (!isspace(*line) &&
+			(left < 9 || strncmp(line, "Received:", 9)) &&
+			(left < 12 || strncmp(line, "Return-Path:", 12)) &&
+			(left < 13 || strncmp(line, "Delivered-To:", 13)))
+			break;
+
+		const char *nl = memchr(line, '\n', left);
+		pos = nl ? nl - base + 1 : len;
 	}
 
-	while (n < size && (ch = fgetc(data->fp)) != EOF) {
-		if (ch == '\n') {
-			*output++ = '\r';
-			++n;
+	return pos;
+}
+
+static size_t read_callback(char *output, size_t size, size_t nmemb, void *datap)
+{
+	struct user_data *data = datap;
+	size_t room = size * nmemb, n = 0;
+
+	while (n < room && data->pos < data->len) {
+		const char *p = data->base + data->pos;
+
+		if (*p == '\n') {
+			if (!data->cr && (data->pos == 0 || p[-1] != '\r')) {
+				output[n++] = '\r';
+				data->cr = 1;
+			} else {
+				output[n++] = '\n';
+				data->cr = 0;
+				++data->pos;
+			}
+			continue;
 		}
-		*output++ = ch;
-		++n;
+
+		/* Copy up to the next newline in one go */
+		size_t run = data->len - data->pos;
+		if (run > room - n)
+			run = room - n;
+		const char *nl = memchr(p, '\n', run);
+		if (nl)
+			run = nl - p;
+
+		memcpy(output + n, p, run);
+		n += run;
+		data->pos += run;
 	}
 
 	return n;
@@ -219,7 +294,7 @@ static int forward_filter(void)
 	struct entry *ff;
 
 	for (ff = forwardfilter; ff; ff = ff->next)
-		if (strcasestr(sender, ff->str))
+		if (fast_strcasestr(sender, ff->str))
 			return 1;
 
 	return 0;
@@ -235,161 +310,129 @@ static int filter_to(const char *to)
 	return strcmp(p, sender) == 0;
 }
 
-static void do_forward(const char *fname)
+/* Forwarding
+ *
+ * Delivery only queues the message. It is linked into ~/.rtf.forward,
+ * and rtf -Q sends it in the background so a slow relay never holds
+ * up delivery. The forwarder keeps one curl handle, so the SMTP
+ * connection is reused from one message to the next. Failures are
+ * retried with a backoff. The try count is kept in the spool name and
+ * the time of the last try is the mtime, so restarts keep the state.
+ */
+#define FWD_DIR			".rtf.forward"
+#define FWD_IDLE		60				/* seconds between scans */
+#define FWD_MIN_RETRY	60
+#define FWD_MAX_RETRY	(60 * 60)
+#define FWD_MAX_TRIES	72
+
+/* Set up the handle from the [forward] section */
+static int forward_setup(CURL *curl, struct curl_slist **recipients)
 {
-	CURL *curl = NULL;
-	struct curl_slist *recipients = NULL;
 	struct entry *e;
 	int ok = 1; /* we currently always have sender */
-	struct user_data upload_ctx;
-	CURLcode res;
-	char from[128];
 
-	if (forward_filter())
-		return;
-
-	upload_ctx.fname = fname;
-	upload_ctx.output = 0;
-	upload_ctx.fp = fopen(fname, "r");
-	if (!upload_ctx.fp) {
-		syslog(LOG_ERR, "tmpfile %s: %m", fname);
-		return;
-	}
-
-	curl = curl_easy_init();
-	if(!curl) {
-		syslog(LOG_ERR, "Unable to initialize curl");
-		goto cleanup;
-	}
-
-	/* parse the forward list */
 	for (e = forwardlist; e; e = e->next)
 		if (strncmp(e->str, "smtp=", 5) == 0) {
 			curl_easy_setopt(curl, CURLOPT_URL, e->str + 5);
 			ok |= 2;
 		} else if (strncmp(e->str, "to=", 3) == 0) {
-			recipients = curl_slist_append(recipients, e->str + 3);
+			*recipients = curl_slist_append(*recipients, e->str + 3);
 			ok |= 4;
-			if (filter_to(e->str + 3))
-				goto cleanup;
 		}
 
 	if (ok != 7) {
 		syslog(LOG_ERR, "Invalid configuraton: %d", ok);
-		goto cleanup;
+		return -1;
 	}
 
-	curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
-
-	snprintf(from, sizeof(from), "<%s>", sender);
-	curl_easy_setopt(curl, CURLOPT_MAIL_FROM, from);
-
+	curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, *recipients);
 	curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_ctx);
 	curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+	return 0;
+}
 
-	/* Send the message */
-	res = curl_easy_perform(curl);
-	if(res != CURLE_OK)
-		syslog(LOG_ERR, "curl_easy_perform() failed: %s", curl_easy_strerror(res));
+static void do_forward(const char *fname)
+{
+	char path[PATH_SIZE];
+	struct entry *e;
 
-	flags |= FORWARD;
+	if (forward_filter())
+		return;
+
+	for (e = forwardlist; e; e = e->next)
+		if (strncmp(e->str, "to=", 3) == 0 && filter_to(e->str + 3))
+			return;
+
+	snprintf(path, sizeof(path), "%s/%s", home, FWD_DIR);
+	if (mkdir(path, 0700) && errno != EEXIST) {
+		syslog(LOG_ERR, "%s: %m", path);
+		return;
+	}
 
-	forward_log();
+	snprintf(path, sizeof(path), "%s/%s/%s", home, FWD_DIR, tmp_file);
+	if (linkat(AT_FDCWD, fname, AT_FDCWD, path, AT_SYMLINK_FOLLOW)) {
+		syslog(LOG_ERR, "%s: %m", path);
+		return;
+	}
 
-cleanup:
-	fclose(upload_ctx.fp);
-	curl_slist_free_all(recipients);
-	curl_easy_cleanup(curl);
+	flags |= FORWARD;
 }
 #else
 #define do_forward(f)
 #endif
 
-/* Should be NFS safe iff all hostnames are unique. */
-static int create_tmp_file(void)
-{
-	char hostname[64];
-	if (gethostname(hostname, sizeof(hostname))) {
-		syslog(LOG_ERR, "Hostname: %m");
-		return -1;
-	}
-
-	const char *dtline = getenv("DTLINE");
-	const char *rpline = getenv("RPLINE");
-	if (!dtline || !rpline) {
-		syslog(LOG_ERR, "Missing required environment variables.");
-		return -1;
-	}
-
-	snprintf(tmp_file, sizeof(tmp_file), "%ld.%d.%s",
-			 time(NULL), getpid(), hostname);
-	snprintf(tmp_path, sizeof(tmp_path), "%s/Maildir/tmp/%s", home, tmp_file);
-	int fd = creat(tmp_path, 0644);
-	if (fd < 0) {
-		syslog(LOG_ERR, "%s: %m", tmp_path);
-		return -1;
-	}
+/* Where the kernel and filesystem support it, the message is created
+ * with O_TMPFILE. It has no name until publish() links it into its
+ * folder, so a crash never leaves a file in tmp. tmp_path is then
+ * the /proc link to the file so we can still reopen it and hand it
+ * to bogofilter.
+ */
+static int tmp_fd = -1;
 
-	/* Sanitize the environment variables */
-	const char *p;
-	for (p = rpline; *p; ++p)
-		if (isascii(*p))
-			if (write(fd, p, 1) != 1)
-				goto write_error;
-	for (p = dtline; *p; ++p)
-		if (isascii(*p))
-			if (write(fd, p, 1) != 1)
-				goto write_error;
-
-	/* Read the email */
-	int n;
-	while ((n = read(0, buff, sizeof(buff))) > 0)
-		if (write(fd, buff, n) != n)
-			goto write_error;
+static void discard(void)
+{
+	if (tmp_fd < 0)
+		unlink(tmp_path);
+}
 
-	if (fsync(fd))
-		goto write_error;
+/* The message is delivered once the directory entry is on disk */
+static void sync_dir(const char *path)
+{
+	char dir[PATH_SIZE], *p;
 
-	if (close(fd)) {
-		fd = -1;
-		goto write_error;
-	}
+	snprintf(dir, sizeof(dir), "%s", path);
+	if ((p = strrchr(dir, '/')))
+		*p = 0;
 
-	if (n < 0)
-		goto read_error;
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fsync(fd))
+		syslog(LOG_WARNING, "%s: sync: %m", dir);
+	if (fd >= 0)
+		close(fd);
+}
 
-	return 0;
+static int publish(const char *path)
+{
+	int rc;
 
-write_error:
-	syslog(LOG_ERR, "%s: write error", tmp_path);
-	if (fd != -1)
-		close(fd);
-	unlink(tmp_path);
-	return -1;
+	if (tmp_fd >= 0)
+		rc = linkat(AT_FDCWD, tmp_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+	else
+		rc = rename(tmp_path, path);
 
-read_error:
-	syslog(LOG_ERR, "%s: read error", tmp_path);
-	unlink(tmp_path);
-	return -1;
+	if (rc == 0 && durability == DURABLE_STRICT)
+		sync_dir(path);
+	return rc;
 }
 
 /* Called at exit() */
 static void logit(void)
 {
-	if (!logfile)
-		return;
+	char rec[PIPE_BUF];
+	int len;
 
-	FILE *fp = fopen(logfile, "a");
-	if (!fp) {
-		syslog(LOG_ERR, "%s: %m", logfile);
+	if (!logfile)
 		return;
-	}
-
-	if (flock(fileno(fp), LOCK_EX)) {
-		syslog(LOG_ERR, "%s: flock: %m", logfile);
-		/* keep going even if we don't get the lock */
-	}
 
 #define OUT(a, c) ((flags & (a)) ? (c) : '-')
 	/* Last two flags are for learnem */
@@ -399,7 +442,7 @@ static void logit(void)
 	case SAW_APP: spam = 'A'; break;
 	case IS_SPAM | SAW_APP: spam = 'Z'; break;
 	}
-	fprintf(fp, "%-20s %c%c%c%c%c%c%c%c--%c %c %.42s\n", tmp_file,
+	len = snprintf(rec, sizeof(rec), "%-20s %c%c%c%c%c%c%c%c--%c %c %.42s\n", tmp_file,
 			OUT(IS_ME, 'M'), OUT(SAW_FROM, 'F'), OUT(SAW_DATE, 'D'),
 			OUT(IS_HAM, 'H'), OUT(IS_IGNORED, 'I'), spam,
 			OUT(FROM_ME, 'f'), OUT(BOGO_SPAM, 'B'),
@@ -410,15 +453,14 @@ static void logit(void)
 
 		for (i = 0; i < 2; ++i)
 			if (saw_bl[i])
-				fprintf(fp, "%-20s B%c-----%c--- %c %.42s\n", tmp_file,
-						i ? 'S' : 'F', OUT(BOGO_SPAM, 'B'),
-						action, saw_bl[i]->str);
+				len += snprintf(rec + len, sizeof(rec) - len,
+								"%-20s B%c-----%c--- %c %.42s\n", tmp_file,
+								i ? 'S' : 'F', OUT(BOGO_SPAM, 'B'),
+								action, saw_bl[i]->str);
 	}
 
-	if (ferror(fp))
-		syslog(LOG_ERR, "%s: write error", logfile);
-
-	fclose(fp);
+	/* One write for the whole record */
+	eventlog_write(rec, len);
 }
 
 static int add_folder(struct entry *new, const char *str)
@@ -464,6 +506,7 @@ static int add_entry(struct entry **head, const char *str)
 		return add_folder(new, str);
 
 	if (*str == '+') {
+		new->regex = 1;
 		new->reg = malloc(sizeof(regex_t));
 		if (!new->reg) goto oom;
 
@@ -499,11 +542,30 @@ static void blacklist_count(const struct entry *e, int index)
 	saw_bl[index] = e;
 }
 
+static void global_option(const char *line)
+{
+	if (strcmp(line, "durability=strict") == 0)
+		durability = DURABLE_STRICT;
+	else if (strcmp(line, "durability=group") == 0)
+		durability = DURABLE_GROUP;
+	else if (strcmp(line, "durability=none") == 0)
+		durability = DURABLE_NONE;
+	else if (strncmp(line, "group_ms=", 9) == 0) {
+		group_ms = strtol(line + 9, NULL, 10);
+		if (group_ms < 1)
+			group_ms = 1;
+	} else if (just_checking)
+		printf("Bad global: %s\n", line);
+	else
+		/* just a warning, failing would stop the cache being saved */
+		syslog(LOG_WARNING, "Bad global: %s", line);
+}
+
 static int read_config(void)
 {
 	char fname[PATH_SIZE];
 	struct entry **head = NULL;
-	int rc = 0;
+	int rc = 0, global = 0;
 
 	snprintf(fname, sizeof(fname), "%s/.rtf", home);
 
@@ -522,7 +584,10 @@ static int read_config(void)
 		if (!p || *p == '#')
 			continue;
 		if (*line == '[') {
-			if (strcmp(line, "[whitelist]") == 0)
+			global = strcmp(line, "[global]") == 0;
+			if (global)
+				head = NULL;
+			else if (strcmp(line, "[whitelist]") == 0)
 				head = &whitelist;
 			else if (strcmp(line, "[blacklist]") == 0)
 				head = &blacklist;
@@ -544,15 +609,355 @@ static int read_config(void)
 			}
 		} else if (head)
 			rc |= add_entry(head, line);
+		else if (global)
+			global_option(line);
 	}
 
 	fclose(fp);
 	return rc;
 }
 
+/* Sets the list and index of the match list entries and chains the
+ * regular expressions. Returns the number of entries.
+ */
+static unsigned link_lists(void)
+{
+	unsigned id = 0;
+
+	for (int i = 0; i < N_LISTS; ++i) {
+		struct entry **reg = &reglist[i];
+		unsigned index = 0;
+
+		for (struct entry *e = *config_lists[i]; e; e = e->next, ++id) {
+			e->list = i;
+			e->index = index++;
+			if (e->regex) {
+				*reg = e;
+				reg = &e->next_reg;
+			}
+			if (match_entries)
+				match_entries[id] = e;
+		}
+	}
+
+	return id;
+}
+
+/* Compile the lists into the matcher. The matcher ids are the index
+ * in match_entries. If this fails, list_filter() falls back to
+ * walking the lists.
+ */
+static void compile_lists(void)
+{
+	unsigned n = link_lists();
+	/* at least one so an empty config does not look like a failure */
+	match_entries = malloc((n ? n : 1) * sizeof(struct entry *));
+	matcher = matcher_new();
+	if (!match_entries || !matcher)
+		goto failed;
+
+	link_lists();
+	for (unsigned id = 0; id < n; ++id) {
+		struct entry *e = match_entries[id];
+
+		if (e->regex) {
+			char lits[MAX_LITERALS][MAX_LITERAL_LEN];
+			int n_lits = regex_literals(e->str + 1, lits);
+
+			for (int j = 0; j < n_lits; ++j)
+				if (matcher_add(matcher, lits[j], id))
+					goto failed;
+			e->gated = n_lits > 0;
+		} else if (matcher_add(matcher, e->str, id))
+			goto failed;
+	}
+
+	if (matcher_compile(matcher) == 0)
+		return;
+
+failed:
+	syslog(LOG_WARNING, "Unable to compile lists");
+	matcher_free(matcher);
+	matcher = NULL;
+}
+
+/* Rule cache
+ *
+ * rtf is run once per message, so parsing the config and compiling
+ * the lists for every message adds up. After compiling, the lists and
+ * the matcher are saved in ~/.rtf.cache. Later runs map the cache and
+ * use it as is if it was built from the same config. Regular
+ * expressions in the cache are compiled the first time they are
+ * needed.
+ *
+ * Layout: header, entries, string table, matcher image.
+ */
+#define CACHE_MAGIC		0x43465452 /* RTFC */
+#define CACHE_VERSION	2
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+	/* identifies the config */
+	int64_t mtime, mtime_nsec;
+	int64_t size;
+	uint64_t hash;
+
+	uint32_t n_entries;
+	uint32_t strings;		/* offset of the string table */
+	uint32_t matcher;		/* offset of the matcher image */
+	uint32_t matcher_len;
+	/* [global] */
+	int32_t durability;
+	int32_t group_ms;
+};
+
+struct cache_entry {
+	uint32_t str;
+	uint32_t folder;		/* 0 for none */
+	uint16_t list;
+	uint16_t flags;
+};
+
+#define CACHE_REGEX		1
+#define CACHE_GATED		2
+
+/* Fills in the config part of the header. */
+static int config_id(struct cache_header *hdr)
+{
+	char fname[PATH_SIZE];
+	struct stat sbuf;
+
+	snprintf(fname, sizeof(fname), "%s/.rtf", home);
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &sbuf)) {
+		close(fd);
+		return -1;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = CACHE_MAGIC;
+	hdr->version = CACHE_VERSION;
+	hdr->mtime = sbuf.st_mtim.tv_sec;
+	hdr->mtime_nsec = sbuf.st_mtim.tv_nsec;
+	hdr->size = sbuf.st_size;
+
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int n;
+	while ((n = read(fd, buff, sizeof(buff))) > 0)
+		for (int i = 0; i < n; ++i) {
+			hash ^= (uint8_t)buff[i];
+			hash *= 0x100000001b3ULL;
+		}
+	hdr->hash = hash;
+
+	close(fd);
+	return n;
+}
+
+static void save_cache(void)
+{
+	struct cache_header hdr;
+	char fname[PATH_SIZE], tmpname[PATH_SIZE + 16];
+
+	if (!matcher || config_id(&hdr))
+		return;
+	hdr.durability = durability;
+	hdr.group_ms = group_ms;
+
+	snprintf(fname, sizeof(fname), "%s/.rtf.cache", home);
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", fname, getpid());
+	FILE *fp = fopen(tmpname, "w");
+	if (!fp) {
+		syslog(LOG_WARNING, "%s: %m", tmpname);
+		return;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto failed;
+
+	/* Offset 0 in the string table is the empty string */
+	uint32_t offset = 1;
+	int i;
+	struct entry *e;
+
+	for (i = 0; i < N_ALL_LISTS; ++i)
+		for (e = *config_lists[i]; e; e = e->next) {
+			struct cache_entry ce = { .list = i };
+
+			ce.str = offset;
+			offset += strlen(e->str) + 1;
+			if (e->folder) {
+				ce.folder = offset;
+				offset += strlen(e->folder) + 1;
+			}
+			if (e->regex)
+				ce.flags |= CACHE_REGEX;
+			if (e->gated)
+				ce.flags |= CACHE_GATED;
+			if (fwrite(&ce, sizeof(ce), 1, fp) != 1)
+				goto failed;
+			++hdr.n_entries;
+		}
+
+	hdr.strings = ftell(fp);
+	if (fputc(0, fp) == EOF)
+		goto failed;
+	for (i = 0; i < N_ALL_LISTS; ++i)
+		for (e = *config_lists[i]; e; e = e->next) {
+			if (fwrite(e->str, strlen(e->str) + 1, 1, fp) != 1)
+				goto failed;
+			if (e->folder && fwrite(e->folder, strlen(e->folder) + 1, 1, fp) != 1)
+				goto failed;
+		}
+
+	while (ftell(fp) & 7)
+		if (fputc(0, fp) == EOF)
+			goto failed;
+
+	hdr.matcher = ftell(fp);
+	long len = matcher_write(matcher, fp);
+	if (len < 0)
+		goto failed;
+	hdr.matcher_len = len;
+
+	rewind(fp);
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto failed;
+
+	if (fclose(fp)) {
+		fp = NULL;
+		goto failed;
+	}
+
+	if (rename(tmpname, fname))
+		goto failed;
+	return;
+
+failed:
+	syslog(LOG_WARNING, "%s: write failed", tmpname);
+	if (fp)
+		fclose(fp);
+	unlink(tmpname);
+}
+
+/* Returns the string at off in the string table or NULL if it runs
+ * off the end of the table.
+ */
+static const char *cache_string(const char *strings, size_t len, uint32_t off)
+{
+	if (off >= len || !memchr(strings + off, 0, len - off))
+		return NULL;
+	return strings + off;
+}
+
+/* Returns 0 if the lists were loaded from the cache. */
+static int load_cache(void)
+{
+	struct cache_header id;
+	char fname[PATH_SIZE];
+	struct stat sbuf;
+
+	if (config_id(&id))
+		return -1;
+
+	snprintf(fname, sizeof(fname), "%s/.rtf.cache", home);
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &sbuf) || sbuf.st_size < sizeof(struct cache_header)) {
+		close(fd);
+		return -1;
+	}
+
+	const char *base = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	const struct cache_header *hdr = (const void *)base;
+	size_t size = sbuf.st_size;
+
+	/* A stale cache is simply ignored and will be rewritten */
+	if (hdr->magic != id.magic || hdr->version != id.version ||
+		hdr->mtime != id.mtime || hdr->mtime_nsec != id.mtime_nsec ||
+		hdr->size != id.size || hdr->hash != id.hash ||
+		hdr->strings > hdr->matcher || hdr->matcher > size ||
+		hdr->matcher_len != size - hdr->matcher ||
+		sizeof(*hdr) + (uint64_t)hdr->n_entries * sizeof(struct cache_entry) > hdr->strings)
+		goto stale;
+
+	struct entry *entries = calloc(hdr->n_entries, sizeof(struct entry));
+	if (!entries)
+		goto stale;
+
+	const struct cache_entry *ce = (const void *)(hdr + 1);
+	const char *strings = base + hdr->strings;
+	size_t strings_len = hdr->matcher - hdr->strings;
+	struct entry **tail[N_ALL_LISTS];
+	int i;
+
+	for (i = 0; i < N_ALL_LISTS; ++i)
+		tail[i] = config_lists[i];
+
+	for (i = 0; i < hdr->n_entries; ++i, ++ce) {
+		struct entry *e = &entries[i];
+
+		if (ce->list >= N_ALL_LISTS)
+			goto corrupt;
+		e->str = cache_string(strings, strings_len, ce->str);
+		if (!e->str)
+			goto corrupt;
+		if (ce->folder && !(e->folder = cache_string(strings, strings_len, ce->folder)))
+			goto corrupt;
+		e->regex = (ce->flags & CACHE_REGEX) != 0;
+		e->gated = (ce->flags & CACHE_GATED) != 0;
+
+		*tail[ce->list] = e;
+		tail[ce->list] = &e->next;
+	}
+
+	match_entries = malloc((hdr->n_entries ? hdr->n_entries : 1) * sizeof(struct entry *));
+	if (!match_entries)
+		goto corrupt;
+
+	/* The matcher ids index match_entries */
+	matcher = matcher_map(base + hdr->matcher, hdr->matcher_len, link_lists());
+	if (!matcher)
+		goto corrupt;
+
+	durability = hdr->durability;
+	group_ms = hdr->group_ms;
+	return 0;
+
+corrupt:
+	for (i = 0; i < N_ALL_LISTS; ++i)
+		*config_lists[i] = NULL;
+	memset(reglist, 0, sizeof(reglist));
+	matcher_free(matcher);
+	matcher = NULL;
+	free(match_entries);
+	match_entries = NULL;
+	free(entries);
+stale:
+	munmap((void *)base, size);
+	return -1;
+}
+
 static int run_bogofilter(const char *fname, char *flags)
 {
-	if (run_bogo) {
+	if (run_bogo && use_bayes) {
+		if (*flags == 0)
+			return bayes_classify(fname);
+		if (!dry_run)
+			bayes_register(fname, strcmp(flags, "-s") == 0);
+		return 0;
+	} else if (run_bogo) {
 		char cmd[256];
 		snprintf(cmd, sizeof(cmd) - 3, "%s %s -B %s", BOGOFILTER, flags, fname);
 		return WEXITSTATUS(system(cmd));
@@ -566,9 +971,9 @@ static void _safe_rename(const char *path)
 		printf("Action %c\n", action);
 		exit(0);
 	}
-	if (rename(tmp_path, path)) {
+	if (publish(path)) {
 		syslog(LOG_WARNING, "%s: %m", path);
-		unlink(tmp_path);
+		discard();
 		exit(0); /* continue */
 	}
 }
@@ -608,26 +1013,131 @@ static inline void ignore(void) { safe_rename(IGNORE_DIR); }
 
 static inline void drop(void) { safe_rename(DROP_DIR); }
 
+static void note_hit(unsigned id, void *arg)
+{
+	struct entry *e = match_entries[id];
+	struct entry *hit = hits[e->list];
+
+	if (e->regex)
+		e->seen = cur_line;
+	else if (!hit || e->index < hit->index)
+		hits[e->list] = e;
+}
+
+/* One pass over the line for all the lists. Must be called before
+ * list_filter() is called for the line.
+ */
+static void match_line(const char *line)
+{
+	memset(hits, 0, sizeof(hits));
+	++cur_line;
+	if (matcher) {
+		uint64_t start = stats_clock();
+		matcher_scan(matcher, line, note_hit, NULL);
+		stats_add(scan_stats, 0, stats_clock() - start);
+	}
+}
+
+static void count_rule(struct entry *e, int hit, uint64_t nsec)
+{
+	if (!e->stats)
+		e->stats = stats_rule(list_names[e->list], e->str);
+	stats_add(e->stats, hit, nsec);
+}
+
+static int regex_match(struct entry *e, const char *line)
+{
+	regmatch_t match[1];
+	int rc;
+
+	if (!e->reg) {
+		e->reg = malloc(sizeof(regex_t));
+		if (!e->reg || regcomp(e->reg, e->str + 1, REGEXP_FLAGS)) {
+			syslog(LOG_WARNING, "Bad regexp '%s'", e->str);
+			free(e->reg);
+			e->reg = NULL;
+			return 0;
+		}
+	}
+
+	uint64_t start = stats_clock();
+	rc = regexec(e->reg, line, 1, match, 0) == 0;
+	count_rule(e, rc, stats_clock() - start);
+	return rc;
+}
+
+/* The first entry in the list that matches wins. */
 static const struct entry *list_filter(const char *line, struct entry * const head)
 {
 	struct entry *e;
 
-	for (e = head; e; e = e->next) {
-		if (e->reg) {
-			regmatch_t match[1];
+	if (!head)
+		return NULL;
 
-			if (regexec(e->reg, line, 1, match, 0) == 0)
+	if (!matcher) {
+		for (e = head; e; e = e->next)
+			if (e->regex) {
+				if (regex_match(e, line))
+					return e;
+			} else if (fast_strcasestr(line, e->str)) {
+				count_rule(e, 1, 0);
 				return e;
-		} else if (strcasestr(line, e->str))
+			}
+		return NULL;
+	}
+
+	struct entry *hit = hits[head->list];
+	for (e = reglist[head->list]; e; e = e->next_reg) {
+		if (hit && hit->index < e->index)
+			break;
+		if (e->gated && e->seen != cur_line)
+			continue;
+		if (regex_match(e, line))
 			return e;
 	}
 
-	return NULL;
+	if (hit)
+		count_rule(hit, 1, 0);
+	return hit;
 }
 
+/* The application/ subtypes to drop and the -a level they need.
+ * The slots are a perfect hash of the length and two of the chars:
+ * (len + s[a] + s[len / 2] * m) & 31. Trying a = 0..2 and m = 1..63
+ * in order, a = 2, m = 12 is the first with no collisions. If you add
+ * a type, tests/test_apps.c finds the misplaced slots and searches
+ * again.
+ */
+#define APP_HASH(s, len)	(((len) + (s)[2] + (s)[(len) / 2] * 12) & 31)
+#define APP_MAX_LEN			48
+
+static const struct app_type {
+	const char *name;
+	int level;
+} app_types[32] = {
+	[1] = { "rar", 1 },
+	[4] = { "octet-stream", 1 },
+	[6] = { "x-zip-compressed", 1 },
+	[7] = { "x-compressed", 1 },
+	[12] = { "vnd.ms-excel", 2 },
+	[13] = { "x-compress", 1 },
+	[14] = { "vnd.ms-excel.addin.macroenabled.12", 2 },
+	[15] = { "x-rar", 1 },
+	[16] = { "vnd.ms-word.document.macroenabled.12", 2 },
+	[21] = { "vnd.ms-excel.template.macroenabled.12", 2 },
+	[22] = { "vnd.ms-excel.sheet.macroenabled.12", 2 },
+	[23] = { "x-zip", 1 },
+	[25] = { "vnd.ms-excel.sheet.binary.macroenabled.12", 2 },
+	[30] = { "x-rar-compressed", 1 },
+	[31] = { "zip", 1 },
+};
+
 /* Returns 1 if type should be dropped */
 static int check_type(const char *type)
 {
+	char sub[APP_MAX_LEN];
+	int len;
+
 	while (isspace(*type))
 		++type;
 
@@ -636,48 +1146,24 @@ static int check_type(const char *type)
 
 	type += 12;
 
-	switch (*type) {
-	case 'x':
-		/* Catch x-compress and x-compressed */
-		if (strncmp(type, "x-compress", 10) == 0)
-			return 1;
-		/* x-zip and x-zip-compressed */
-		if (strncmp(type, "x-zip", 5) == 0)
-			return 1;
-		/* x-rar and x-rar-compressed */
-		if (strncmp(type, "x-rar", 5) == 0)
-			return 1;
-		break;
-	case 'z':
-		if (strncmp(type, "zip", 3) == 0)
-			return 1;
-		break;
-	case 'r':
-		if (strncmp(type, "rar", 5) == 0)
-			return 1;
-		break;
-	case 'v':
-		/* Not sure about these... */
-		if (drop_apps > 1) {
-			if (strncmp(type, "vnd.ms-word.document.macroEnabled", 33) == 0)
-				return 1;
-			if (strncmp(type, "vnd.ms-excel", 12) == 0)
-				return 1;
-		}
-		break;
-	case 'o':
-		if (strncmp(type, "octet-stream", 12) == 0)
-			return 1;
-		break;
+	for (len = 0; type[len] && type[len] != ';' && !isspace(type[len]); ++len) {
+		if (len == APP_MAX_LEN - 1)
+			return 0;
+		sub[len] = tolower(type[len]);
 	}
+	sub[len] = 0;
+	if (len < 3)
+		return 0;
 
-	return 0;
+	const struct app_type *t = &app_types[APP_HASH(sub, len)];
+	return t->name && drop_apps >= t->level && strcmp(sub, t->name) == 0;
 }
 
 static inline void filter_from(const char *from)
 {
 	const struct entry *e;
 
+	match_line(from);
 	if (list_filter(from, whitelist))
 		flags |= IS_HAM;
 	if (list_filter(from, graylist))
@@ -710,14 +1196,15 @@ static int isok(char c)
 }
 
 /* Check for a one name from */
-static void check_one_name_from(char *subject, char *from)
+/* Returns 1 for a "one name" from */
+static int one_name_from(const char *from)
 {
 	from += 5; /* skip From: */
 	while (isspace(*from)) ++from;
 	while (isok(*from)) ++from;
 	while (isspace(*from)) ++from;
 	if (*from && *from != '<')
-		return;
+		return 0;
 
 	/* We have a "one name" from */
 
@@ -730,9 +1217,7 @@ static void check_one_name_from(char *subject, char *from)
 		}
 	}
 
-	action = 'S';
-	run_bogofilter(tmp_path, "-s");
-	spam();
+	return 1;
 }
 
 static void normalize_subject(const char *str)
@@ -756,111 +1241,323 @@ static void normalize_subject(const char *str)
 	subject[end + 1] = 0;
 }
 
-static void filter(void)
+static char *from_line;
+
+/* Streaming header parser
+ *
+ * The message is classified as it is spooled so it never has to be
+ * read back. Folded lines are unfolded before they are classified, so
+ * a long To: is one line.
+ *
+ * After the header, we only need to keep looking for app attachments.
+ * Only the MIME part headers are parsed. The part bodies are skipped
+ * by looking for the next line starting with --, and we stop at the
+ * first app or at the last boundary.
+ */
+#define HDR_LINE_SIZE (32 * 1024)
+
+#define MIME_DEPTH		8
+#define MIME_BOUNDARY	72 /* max is 70 */
+
+enum { HDR_LINE, HDR_EOL, HDR_BOL, HDR_SKIP, HDR_DONE };
+
+static struct {
+	char line[HDR_LINE_SIZE];
+	size_t len;
+	int state;
+	int part;		/* past the message header */
+	int rfc822;		/* the part has its own header */
+	int n_bound;
+	int bound_len[MIME_DEPTH];
+	char bound[MIME_DEPTH][MIME_BOUNDARY];
+} hdr = { .state = HDR_EOL };
+
+/* Content-Type of the message or a part */
+static void content_type(const char *type)
+{
+	if (check_type(type))
+		flags |= SAW_APP;
+
+	while (isspace(*type))
+		++type;
+
+	if (strncasecmp(type, "message/rfc822", 14) == 0) {
+		hdr.rfc822 = 1;
+		return;
+	}
+	if (strncasecmp(type, "multipart/", 10) || hdr.n_bound == MIME_DEPTH)
+		return;
+
+	const char *p = strcasestr(type, "boundary=");
+	if (!p)
+		return;
+	p += 9;
+
+	int quoted = *p == '"', len = 0;
+	char *bound = hdr.bound[hdr.n_bound];
+	if (quoted)
+		++p;
+	for (; p[len] && len < MIME_BOUNDARY - 1; ++len) {
+		if (quoted ? p[len] == '"' : (p[len] == ';' || isspace(p[len])))
+			break;
+		bound[len] = p[len];
+	}
+	if (len > 0)
+		hdr.bound_len[hdr.n_bound++] = len;
+}
+
+/* Classify one unfolded header line */
+static void header_line(char *line)
 {
 	const struct entry *e;
-	char *from = NULL;
-	FILE *fp = fopen(tmp_path, "r");
-	if (!fp) {
-		syslog(LOG_WARNING, "%s: %m", tmp_path);
-		unlink(tmp_path);
-		exit(0);
+
+	if (strncasecmp(line, "To:", 3) == 0 ||
+		strncasecmp(line, "Cc:", 3) == 0 ||
+		strncasecmp(line, "Bcc:", 4) == 0) {
+		match_line(line);
+		if (list_filter(line, whitelist))
+			flags |= IS_HAM;
+		if (list_filter(line, melist))
+			flags |= IS_ME;
+		if ((e = list_filter(line, folderlist)))
+			folder_match = e->folder;
+	} else if (strncasecmp(line, "From:", 5) == 0) {
+		flags |= SAW_FROM;
+		filter_from(line);
+		from_line = strdup(line);
+		if ((e = list_filter(line, folderlist)))
+			folder_match = e->folder;
+	} else if (strncasecmp(line, "Subject:", 8) == 0) {
+		normalize_subject(line);
+		match_line(line);
+		if ((e = list_filter(line, blacklist))) {
+			flags |= IS_SPAM;
+			blacklist_count(e, 1);
+		} else if ((e = list_filter(line, folderlist)))
+			folder_match = e->folder;
+	} else if (strncasecmp(line, "Date:", 5) == 0)
+		flags |= SAW_DATE;
+	else if (strncasecmp(line, "Content-Type:", 13) == 0)
+		content_type(line + 13);
+	else if (strncasecmp(line, "List-Post:", 10) == 0) {
+		match_line(line);
+		if ((e = list_filter(line, folderlist)))
+			folder_match = e->folder;
 	}
+}
 
-	/* Also filter sender. This is mainly for mailing lists but can
-	 * also catch people who fake the from.
-	 */
-	filter_from(sender);
+/* Lines that do not fit are truncated */
+static inline void hdr_add(const char *p, size_t n)
+{
+	if (n > sizeof(hdr.line) - 1 - hdr.len)
+		n = sizeof(hdr.line) - 1 - hdr.len;
+	memcpy(hdr.line + hdr.len, p, n);
+	hdr.len += n;
+}
+
+static void hdr_emit(void)
+{
+	if (hdr.len > 0 && hdr.line[hdr.len - 1] == '\r')
+		--hdr.len;
+	if (hdr.len == 0)
+		return;
+	hdr.line[hdr.len] = 0;
+	hdr.len = 0;
 
-	while (fgets(buff, sizeof(buff), fp)) {
-		if (*buff == '\n')
-			break; /* end of header */
-		else if (strncasecmp(buff, "To:", 3) == 0 ||
-				 strncasecmp(buff, "Cc:", 3) == 0 ||
-				 strncasecmp(buff, "Bcc:", 4) == 0) {
-			if (list_filter(buff, whitelist))
-				flags |= IS_HAM;
-			if (list_filter(buff, melist))
-				flags |= IS_ME;
-			if ((e = list_filter(buff, folderlist)))
-				folder_match = e->folder;
-		} else if (strncasecmp(buff, "From:", 5) == 0) {
-			flags |= SAW_FROM;
-			filter_from(buff);
-			from = strdup(buff);
-			if ((e = list_filter(buff, folderlist)))
-				folder_match = e->folder;
-		} else if (strncasecmp(buff, "Subject:", 8) == 0) {
-			normalize_subject(buff);
-			if ((e = list_filter(buff, blacklist))) {
-				flags |= IS_SPAM;
-				blacklist_count(e, 1);
-			} else if ((e = list_filter(buff, folderlist)))
-				folder_match = e->folder;
-		} else if (strncasecmp(buff, "Date:", 5) == 0)
-			flags |= SAW_DATE;
-		else if (strncasecmp(buff, "Content-Type:", 13) == 0) {
-			if (check_type(buff + 13))
-				flags |= SAW_APP;
-		} else if (strncasecmp(buff, "List-Post:", 10) == 0) {
-			if ((e = list_filter(buff, folderlist)))
-				folder_match = e->folder;
-		}
-	}
-
-	if (drop_apps && !(flags & SAW_APP))
-		while (fgets(buff, sizeof(buff), fp))
-			if (strncasecmp(buff, "Content-Type:", 13) == 0)
-				if (check_type(buff + 13)) {
-					flags |= SAW_APP;
-					break;
-				}
+	if (!hdr.part)
+		header_line(hdr.line);
+	else if (strncasecmp(hdr.line, "Content-Type:", 13) == 0)
+		content_type(hdr.line + 13);
+}
 
-	fclose(fp);
+/* Returns the state after a blank line ends a header */
+static int hdr_end(void)
+{
+	if (!drop_apps || (flags & SAW_APP))
+		return HDR_DONE;
+
+	hdr.part = 1;
+	if (hdr.rfc822) {
+		hdr.rfc822 = 0;
+		return HDR_EOL;
+	}
+	return hdr.n_bound ? HDR_BOL : HDR_DONE;
+}
+
+/* Returns the state after a body line that might be a boundary */
+static int boundary_line(void)
+{
+	const char *line = hdr.line;
+	size_t len = hdr.len;
+
+	hdr.len = 0;
+	while (len > 0 && isspace(line[len - 1]))
+		--len;
+	if (len < 2 || line[0] != '-' || line[1] != '-')
+		return HDR_SKIP;
+
+	/* An outer boundary also ends the inner parts */
+	for (int i = hdr.n_bound - 1; i >= 0; --i) {
+		size_t blen = hdr.bound_len[i];
+
+		if (len < blen + 2 || memcmp(line + 2, hdr.bound[i], blen))
+			continue;
+		if (len == blen + 2) {
+			hdr.n_bound = i + 1;
+			hdr.rfc822 = 0;
+			return HDR_EOL; /* next part */
+		}
+		if (len == blen + 4 && line[blen + 2] == '-' && line[blen + 3] == '-') {
+			hdr.n_bound = i;
+			return hdr.n_bound ? HDR_SKIP : HDR_DONE;
+		}
+	}
+
+	return HDR_SKIP;
+}
+
+/* Returns 0 once it has seen all it needs */
+static int parse(const char *buf, size_t n)
+{
+	const char *end = buf + n, *nl;
+
+	while (buf < end)
+		switch (hdr.state) {
+		case HDR_EOL:
+			/* A line is only complete when the next one is not a
+			 * continuation line.
+			 */
+			if (*buf == ' ' || *buf == '\t') {
+				hdr.state = HDR_LINE;
+				break;
+			}
+			hdr_emit();
+			if (hdr.part && (flags & SAW_APP)) {
+				hdr.state = HDR_DONE;
+				return 0;
+			}
+			if (*buf == '\r') {
+				++buf;
+				break;
+			}
+			if (*buf == '\n') {
+				/* end of header */
+				++buf;
+				hdr.state = hdr_end();
+				if (hdr.state == HDR_DONE)
+					return 0;
+				break;
+			}
+			hdr.state = HDR_LINE;
+			break;
+		case HDR_LINE:
+		case HDR_BOL:
+			nl = memchr(buf, '\n', end - buf);
+			if (!nl) {
+				hdr_add(buf, end - buf);
+				return 1;
+			}
+			hdr_add(buf, nl - buf);
+			if (hdr.state == HDR_LINE) {
+				buf = nl + 1;
+				hdr.state = HDR_EOL;
+				break;
+			}
+			hdr.state = boundary_line();
+			if (hdr.state == HDR_DONE)
+				return 0;
+			/* skipping starts at the newline */
+			buf = hdr.state == HDR_SKIP ? nl : nl + 1;
+			break;
+		case HDR_SKIP:
+			/* Jump to the next line that could be a boundary */
+			nl = memmem(buf, end - buf, "\n--", 3);
+			if (nl) {
+				buf = nl + 1;
+				hdr.state = HDR_BOL;
+				break;
+			}
+			/* The \n-- can be split across reads */
+			if (end[-1] == '\n')
+				hdr.state = HDR_BOL;
+			else if (end - buf >= 2 && end[-2] == '\n' && end[-1] == '-') {
+				hdr_add("-", 1);
+				hdr.state = HDR_BOL;
+			}
+			return 1;
+		case HDR_DONE:
+			return 0;
+		}
+
+	return hdr.state != HDR_DONE;
+}
+
+/* Called at EOF */
+static void parse_end(void)
+{
+	if (hdr.state == HDR_LINE || hdr.state == HDR_EOL)
+		hdr_emit();
+	hdr.state = HDR_DONE;
+}
 
+/* Applies the rules in order and returns the action */
+static char classify(void)
+{
 	if (!train_bogo)
 		/* Just check the mail... do not update the word lists */
 		if (run_bogofilter(tmp_path, "") == 0)
 			flags |= BOGO_SPAM;
 
 	/* Rule 1 */
-	if (flags & IS_IGNORED) {
-		/* Tell bogofilter this is ham */
-		action = 'I';
-		run_bogofilter(tmp_path, "-n");
-		ignore();
-	}
+	if (flags & IS_IGNORED)
+		return 'I';
 	/* Rule 2 */
-	if (flags & IS_HAM) {
-		/* Tell bogofilter this is ham */
-		action = 'H';
-		run_bogofilter(tmp_path, "-n");
-		ham();
-	}
+	if (flags & IS_HAM)
+		return 'H';
 	/* Rule 3, 4, 6 */
 	if ((flags & (IS_SPAM | BOGO_SPAM | FROM_ME)) ||
 		/* Rule 5 */
 		(flags & SAW_FROM) == 0 || (flags & SAW_DATE) == 0 ||
 		/* Rule 7 */
-		(run_drop && (flags & IS_ME) == 0)) {
+		(run_drop && (flags & IS_ME) == 0))
+		return 'S';
+	/* Rule 8 */
+	if (drop_apps && (flags & SAW_APP))
+		return 'D';
+
+	/* SAM HACK */
+	if (one_name_from(from_line))
+		return 'S';
+
+	return 'h';
+}
+
+static void filter(void)
+{
+	action = classify();
+
+	switch (action) {
+	case 'I':
+		/* Tell bogofilter this is ham */
+		run_bogofilter(tmp_path, "-n");
+		ignore();
+		break;
+	case 'H':
+	case 'h':
+		/* Tell bogofilter this is ham */
+		run_bogofilter(tmp_path, "-n");
+		ham();
+		break;
+	case 'S':
 		/* Tell bogofilter this is spam */
-		action = 'S';
 		run_bogofilter(tmp_path, "-s");
 		spam();
-	}
-	/* Rule 8 */
-	if (drop_apps && (flags & SAW_APP)) {
-		action = 'D';
+		break;
+	case 'D':
 		run_bogofilter(tmp_path, "-s");
 		drop();
+		break;
 	}
-
-	/* SAM HACK */
-	check_one_name_from(subject, from);
-
-	action = 'h';
-	run_bogofilter(tmp_path, "-n");
-	ham();
 }
 
 static int setup_file(const char *fname)
@@ -883,50 +1580,163 @@ static int setup_file(const char *fname)
 	return 0;
 }
 
-static void usage(void)
+/* Returns a malloced copy of str with the non-ascii chars removed */
+static char *sanitize(const char *str, size_t *len)
 {
-	puts("usage:\trtf [-abcdfnCT] [-l logfile] [-F file]\n"
-		 "where:\t-a   drop emails with app attachments\n"
-		 "\t-b   run bogofilter\n"
-		 "\t-c   add blacklist counts to logfile\n"
-		 "\t-d   mark emails not 'from me' as spam\n"
-		 "\t-f   forward emails\n"
-		 "\t-h   this help\n"
-		 "\t-n   dry run (mainly used with -F)\n"
-		 "\t-C   just check the config file\n"
-		 "\t     validates any regular expressions\n"
-		 "\t-F   mainly for debugging rtf\n"
-		 "\t-T   train bogofilter"
-		);
+	char *out = malloc(strlen(str) + 1);
+	if (!out)
+		return NULL;
+
+	char *p = out;
+	for (; *str; ++str)
+		if (isascii(*str))
+			*p++ = *str;
+	*len = p - out;
+	return out;
 }
 
-int main(int argc, char *argv[])
+/* Copy stdin to fd. Pipes are spliced and files copied in the kernel,
+ * anything else (e.g. the rtf -D socket) is read and written.
+ */
+static int copy_body(int fd)
 {
-	int c, rc;
-	while ((c = getopt(argc, argv, "abcdfhl:nCF:T")) != EOF)
-		switch (c) {
-		case 'a': ++drop_apps; break;
-		case 'b': run_bogo = 1; break;
-		case 'c': add_blacklist = 1; break;
-		case 'd': run_drop = 1; break;
-		case 'f': forward = 1; break;
-		case 'h': usage(); exit(0);
-		case 'l': logfile = optarg; break;
-		case 'n': dry_run = 1; break;
-		case 'C': just_checking = 1; break;
-		case 'F': file_mode = optarg; break;
-		case 'T': train_bogo = run_bogo = 1; break;
+	struct stat sbuf;
+	ssize_t n;
+
+	if (fstat(0, &sbuf) == 0) {
+		if (S_ISFIFO(sbuf.st_mode)) {
+			while ((n = splice(0, NULL, fd, NULL, 1 << 20, SPLICE_F_MOVE)) > 0) ;
+			if (n == 0)
+				return 0;
+			if (errno != EINVAL)
+				return -1;
+		} else if (S_ISREG(sbuf.st_mode)) {
+			while ((n = copy_file_range(0, NULL, fd, NULL, 1 << 30, 0)) > 0) ;
+			if (n == 0)
+				return 0;
+			if (errno != EXDEV && errno != EINVAL && errno != ENOSYS)
+				return -1;
 		}
+		/* Not supported, nothing was copied */
+	}
 
-	home = getenv("HOME");
-	if (!home) {
-		syslog(LOG_WARNING, "You are homeless!");
-		return 0; /* continue */
+	while ((n = read(0, buff, sizeof(buff))) > 0)
+		if (write(fd, buff, n) != n)
+			return -1;
+
+	return n;
+}
+
+/* Should be NFS safe iff all hostnames are unique. */
+static int create_tmp_file(void)
+{
+	char hostname[64];
+	if (gethostname(hostname, sizeof(hostname))) {
+		syslog(LOG_ERR, "Hostname: %m");
+		return -1;
 	}
 
-	rc = read_config();
-	if (just_checking)
-		return rc;
+	const char *dtline = getenv("DTLINE");
+	const char *rpline = getenv("RPLINE");
+	if (!dtline || !rpline) {
+		syslog(LOG_ERR, "Missing required environment variables.");
+		return -1;
+	}
+
+	snprintf(tmp_file, sizeof(tmp_file), "%ld.%d.%s",
+			 time(NULL), getpid(), hostname);
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s/Maildir/tmp", home);
+	int fd = open(tmp_path, O_TMPFILE | O_WRONLY, 0644);
+	if (fd >= 0) {
+		tmp_fd = fd;
+		snprintf(tmp_path, sizeof(tmp_path), "/proc/self/fd/%d", fd);
+	} else {
+		snprintf(tmp_path, sizeof(tmp_path), "%s/Maildir/tmp/%s", home, tmp_file);
+		fd = creat(tmp_path, 0644);
+		if (fd < 0) {
+			syslog(LOG_ERR, "%s: %m", tmp_path);
+			return -1;
+		}
+	}
+
+	/* Sanitize the environment variables */
+	struct iovec iov[2];
+	iov[0].iov_base = sanitize(rpline, &iov[0].iov_len);
+	iov[1].iov_base = sanitize(dtline, &iov[1].iov_len);
+	if (!iov[0].iov_base || !iov[1].iov_base ||
+		writev(fd, iov, 2) != iov[0].iov_len + iov[1].iov_len)
+		goto write_error;
+
+	parse(iov[0].iov_base, iov[0].iov_len);
+	parse(iov[1].iov_base, iov[1].iov_len);
+	free(iov[0].iov_base);
+	free(iov[1].iov_base);
+
+	/* Read the email, classifying it until we have seen enough. Then
+	 * the rest can be copied without looking at it.
+	 */
+	int n, more = 1;
+	while (more && (n = read(0, buff, sizeof(buff))) > 0) {
+		if (write(fd, buff, n) != n)
+			goto write_error;
+		more = parse(buff, n);
+	}
+	if (more) {
+		if (n < 0)
+			goto read_error;
+		parse_end();
+	} else if (copy_body(fd))
+		goto write_error;
+
+	if (durability == DURABLE_STRICT && fdatasync(fd))
+		goto write_error;
+
+	/* Keep the O_TMPFILE open, it goes away when we exit */
+	if (tmp_fd < 0 && close(fd)) {
+		fd = -1;
+		goto write_error;
+	}
+
+	return 0;
+
+write_error:
+	syslog(LOG_ERR, "%s: write error", tmp_path);
+	if (fd != -1)
+		close(fd);
+	discard();
+	return -1;
+
+read_error:
+	syslog(LOG_ERR, "%s: read error", tmp_path);
+	close(fd);
+	discard();
+	return -1;
+}
+
+/* File mode reads the existing message through the parser */
+static int parse_file(void)
+{
+	int fd = open(tmp_path, O_RDONLY);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "%s: %m", tmp_path);
+		return -1;
+	}
+
+	int n, more = 1;
+	while (more && (n = read(fd, buff, sizeof(buff))) > 0)
+		more = parse(buff, n);
+	if (more)
+		parse_end();
+
+	close(fd);
+	return 0;
+}
+
+/* Never returns on success */
+static int deliver(void)
+{
+	int rc;
 
 	if (file_mode)
 		sender = "good-sender";
@@ -938,9 +1748,16 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (file_mode)
+	/* Also filter sender. This is mainly for mailing lists but can
+	 * also catch people who fake the from.
+	 */
+	filter_from(sender);
+
+	if (file_mode) {
 		rc = setup_file(file_mode);
-	else
+		if (rc == 0)
+			rc = parse_file();
+	} else
 		rc = create_tmp_file();
 
 	if (rc < 0)
@@ -952,3 +1769,878 @@ int main(int argc, char *argv[])
 	filter();
 	return 0; /* unreached */
 }
+
+#define OPTIONS "abcdfhl:nCDF:I:QR:ST"
+
+/* Sets the options that only change how a message is delivered.
+ * Returns -1 for any other option.
+ */
+static int delivery_option(int c, char *arg)
+{
+	switch (c) {
+	case 'a': ++drop_apps; break;
+	case 'b': run_bogo = 1; break;
+	case 'c': add_blacklist = 1; break;
+	case 'd': run_drop = 1; break;
+	case 'f': forward = 1; break;
+	case 'l': logfile = arg; break;
+	case 'n': dry_run = 1; break;
+	case 'T': train_bogo = run_bogo = 1; break;
+	default: return -1;
+	}
+	return 0;
+}
+
+/* Daemon mode
+ *
+ * rtf -D keeps the rules compiled and listens on ~/.rtf.sock. The
+ * rtfc client sends the environment and the message and exits with
+ * our exit code. Each message is handled in a forked child so it
+ * still exit()s like a normal rtf run, on_exit() sends the code back.
+ * rtfc also sends its arguments, and the child delivers with those
+ * instead of the daemon's, just as if rtfc had run rtf itself.
+ *
+ * If the config changes the daemon re-execs itself, passing the
+ * listening socket in RTF_LISTEN_FD.
+ *
+ * With durability=group the children do not sync or answer. The
+ * daemon holds on to the connections, collects the exit codes, and
+ * once all the running children are done, or the oldest finished
+ * child has waited group_ms, one syncfs() covers the whole group
+ * before the codes are sent.
+ */
+static int conn_fd;
+
+#define MAX_GROUP		256
+#define GROUP_RUNNING	-1
+#define GROUP_LOST		-2
+
+static struct group {
+	pid_t pid;
+	int fd;
+	int status;
+} group[MAX_GROUP];
+static int n_group;
+static uint64_t group_start;
+static int maildir_fd = -1;
+
+static void send_status(int status, void *arg)
+{
+	unsigned char code = status;
+
+	if (write(conn_fd, &code, 1) != 1)
+		syslog(LOG_WARNING, "status: %m");
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Replace the delivery options with the client's arguments */
+static void client_options(int argc, char **argv)
+{
+	int c;
+
+	drop_apps = run_bogo = add_blacklist = run_drop = 0;
+	forward = dry_run = train_bogo = 0;
+	logfile = NULL;
+
+	opterr = 0; /* stderr is the daemon's */
+	optind = 0; /* start over */
+	while ((c = getopt(argc, argv, OPTIONS)) != EOF)
+		if (delivery_option(c, optarg))
+			syslog(LOG_WARNING, "rtfc: -%c ignored", c == '?' ? optopt : c);
+
+	use_bayes = run_bogo && bayes_open(home) == 0;
+	if (logfile)
+		eventlog_open(logfile);
+}
+
+/* The client sends a length and then NAME=value strings, with an
+ * ARG= string for each of its arguments.
+ */
+static int read_env(int fd)
+{
+	static char *args[64] = { "rtfc" };
+	int n_args = 1;
+	uint32_t len;
+
+	if (read_all(fd, &len, sizeof(len)) || len > RTF_MAX_ENV)
+		return -1;
+
+	char *env = malloc(len + 1);
+	if (!env || read_all(fd, env, len))
+		return -1;
+	env[len] = 0;
+
+	for (char *p = env; p < env + len; p += strlen(p) + 1)
+		if (strncmp(p, "SENDER=", 7) == 0 ||
+			strncmp(p, "DTLINE=", 7) == 0 ||
+			strncmp(p, "RPLINE=", 7) == 0)
+			putenv(p);
+		else if (strncmp(p, "ARG=", 4) == 0 && n_args < 63)
+			args[n_args++] = p + 4;
+
+	client_options(n_args, args);
+	return 0;
+}
+
+static void handle_conn(int fd)
+{
+	signal(SIGCHLD, SIG_DFL); /* for system() */
+
+	for (int i = 0; i < n_group; ++i)
+		close(group[i].fd);
+
+	conn_fd = fd;
+	if (durability != DURABLE_GROUP)
+		on_exit(send_status, NULL);
+
+	if (read_env(fd) || dup2(fd, 0) < 0) {
+		syslog(LOG_WARNING, "Bad client");
+		exit(0);
+	}
+
+	exit(deliver());
+}
+
+static void wake(int signo) {}
+
+static void reap_group(void)
+{
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		for (int i = 0; i < n_group; ++i)
+			if (group[i].pid == pid) {
+				group[i].status = WIFEXITED(status) ? WEXITSTATUS(status) : GROUP_LOST;
+				if (!group_start)
+					group_start = stats_clock();
+				break;
+			}
+}
+
+static void flush_group(void)
+{
+	int i, j, running = 0;
+
+	if (!group_start)
+		return; /* nothing finished */
+
+	for (i = 0; i < n_group; ++i)
+		if (group[i].status == GROUP_RUNNING)
+			++running;
+	if (running && stats_clock() - group_start < group_ms * 1000000ULL)
+		return;
+
+	if (syncfs(maildir_fd))
+		syslog(LOG_ERR, "syncfs: %m");
+
+	for (i = j = 0; i < n_group; ++i) {
+		struct group *g = &group[i];
+
+		if (g->status == GROUP_RUNNING)
+			group[j++] = *g;
+		else {
+			/* A lost child gets no answer, just like without groups */
+			unsigned char code = g->status;
+			if (g->status != GROUP_LOST && write(g->fd, &code, 1) != 1)
+				syslog(LOG_WARNING, "status: %m");
+			close(g->fd);
+		}
+	}
+
+	n_group = j;
+	group_start = 0;
+}
+
+static time_t config_mtime(void)
+{
+	char fname[PATH_SIZE];
+	struct stat sbuf;
+
+	snprintf(fname, sizeof(fname), "%s/.rtf", home);
+	if (stat(fname, &sbuf))
+		return 0;
+	return sbuf.st_mtime;
+}
+
+static int run_daemon(char *argv[])
+{
+	char *fdstr = getenv("RTF_LISTEN_FD");
+	int sock;
+
+	if (fdstr)
+		sock = strtol(fdstr, NULL, 10);
+	else {
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", home, RTF_SOCKET);
+		unlink(addr.sun_path);
+
+		/* Only we can connect */
+		mode_t mask = umask(077);
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock < 0 ||
+			bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(sock, 64)) {
+			syslog(LOG_ERR, "%s: %m", addr.sun_path);
+			return 1;
+		}
+		umask(mask);
+	}
+
+	if (durability == DURABLE_GROUP) {
+		char path[PATH_SIZE];
+
+		snprintf(path, sizeof(path), "%s/Maildir", home);
+		maildir_fd = open(path, O_RDONLY | O_DIRECTORY);
+		if (maildir_fd < 0) {
+			syslog(LOG_ERR, "%s: %m", path);
+			durability = DURABLE_STRICT;
+		}
+	}
+
+	if (durability == DURABLE_GROUP) {
+		/* No SA_RESTART, a child exiting wakes up poll() */
+		struct sigaction sa = { .sa_handler = wake };
+		sigaction(SIGCHLD, &sa, NULL);
+	} else
+		signal(SIGCHLD, SIG_IGN); /* no zombies */
+
+	time_t mtime = config_mtime();
+
+	while (1) {
+		/* The connections in a group do not survive the exec */
+		if (n_group == 0 && config_mtime() != mtime) {
+			char str[16];
+
+			snprintf(str, sizeof(str), "%d", sock);
+			setenv("RTF_LISTEN_FD", str, 1);
+			execv("/proc/self/exe", argv);
+			syslog(LOG_ERR, "re-exec: %m");
+			mtime = config_mtime();
+		}
+
+		struct pollfd pfd = { .fd = n_group < MAX_GROUP ? sock : -1, .events = POLLIN };
+		int n = poll(&pfd, 1, n_group ? group_ms : -1);
+
+		if (durability == DURABLE_GROUP) {
+			reap_group();
+			flush_group();
+		}
+		if (n <= 0)
+			continue;
+
+		int fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR)
+				syslog(LOG_WARNING, "accept: %m");
+			continue;
+		}
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(sock);
+			handle_conn(fd);
+		}
+		if (pid < 0)
+			syslog(LOG_ERR, "fork: %m");
+
+		if (pid > 0 && durability == DURABLE_GROUP) {
+			group[n_group].pid = pid;
+			group[n_group].fd = fd;
+			group[n_group].status = GROUP_RUNNING;
+			++n_group;
+		} else
+			close(fd);
+	}
+}
+
+/* Batch mode
+ *
+ * rtf -R <maildir> re-filters the messages in cur/ and new/ after a
+ * rule change, without a process per message. The names are read up
+ * front, then forked workers take the next message off a shared
+ * counter, map it, and run it through the same parser and rules as a
+ * delivery. Spam, ignore, and drop are moved where a delivery would
+ * put them, ham is left alone. Each worker saves up its moves and does
+ * them with renameat() when it runs out of messages.
+ *
+ * bogofilter is only asked, it is not trained again.
+ */
+#define MAX_WORKERS 64
+
+struct batch_msg {
+	char *name;
+	int new;
+};
+
+struct batch_move {
+	unsigned msg;
+	char action;
+	const char *folder;
+};
+
+static struct {
+	unsigned next;
+	unsigned done;
+	unsigned moved;
+} *batch;
+
+static void reset_message(void)
+{
+	flags = 0;
+	strcpy(subject, "NONE");
+	action = '?';
+	folder_match = NULL;
+	free(from_line);
+	from_line = NULL;
+	saw_bl[0] = saw_bl[1] = NULL;
+	hdr.state = HDR_EOL;
+	hdr.len = 0;
+	hdr.part = hdr.rfc822 = hdr.n_bound = 0;
+}
+
+static int read_names(const char *maildir, int new, struct batch_msg **msgs,
+					  unsigned *n, unsigned *max)
+{
+	char path[PATH_SIZE];
+
+	snprintf(path, sizeof(path), "%s/%s", maildir, new ? "new" : "cur");
+	DIR *dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return -1;
+	}
+
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		if (*ent->d_name == '.')
+			continue;
+
+		if (*n >= *max) {
+			*max += 4096;
+			struct batch_msg *m = realloc(*msgs, *max * sizeof(struct batch_msg));
+			if (!m) {
+				closedir(dir);
+				return -1;
+			}
+			*msgs = m;
+		}
+		(*msgs)[*n].new = new;
+		if (!((*msgs)[*n].name = strdup(ent->d_name))) {
+			closedir(dir);
+			return -1;
+		}
+		++*n;
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/* Returns the action for the message or 0 if it could not be read */
+static char batch_one(const char *maildir, const struct batch_msg *m)
+{
+	char path[PATH_SIZE];
+
+	reset_message();
+
+	if (snprintf(path, sizeof(path), "%s/%s/%s", maildir,
+				 m->new ? "new" : "cur", m->name) >= sizeof(path))
+		return 0;
+	setup_file(path);
+
+	filter_from(sender);
+
+	int fd = open(tmp_path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat sbuf;
+	if (fstat(fd, &sbuf)) {
+		close(fd);
+		return 0;
+	}
+
+	if (sbuf.st_size > 0) {
+		void *msg = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (msg == MAP_FAILED) {
+			close(fd);
+			return 0;
+		}
+		parse(msg, sbuf.st_size);
+		munmap(msg, sbuf.st_size);
+	}
+	parse_end();
+	close(fd);
+
+	char act = classify();
+	return act == 'h' && folder_match ? 'f' : act;
+}
+
+static void batch_moves(const char *maildir, struct batch_msg *msgs,
+						struct batch_move *moves, unsigned n_moves)
+{
+	char path[PATH_SIZE];
+	struct stat sbuf;
+	int src[2], dst[3] = { -1, -1, -1 }, folder_dst = -1;
+	ino_t src_ino[2] = { 0, 0 };
+	const char *folder = NULL;
+	static const char *const subdirs[3] = { SPAM_DIR, IGNORE_DIR, DROP_DIR };
+
+	for (int i = 0; i < 2; ++i) {
+		snprintf(path, sizeof(path), "%s/%s", maildir, i ? "new" : "cur");
+		src[i] = open(path, O_RDONLY | O_DIRECTORY);
+		if (src[i] >= 0 && fstat(src[i], &sbuf) == 0)
+			src_ino[i] = sbuf.st_ino;
+	}
+
+	for (unsigned i = 0; i < n_moves; ++i) {
+		const struct batch_msg *m = &msgs[moves[i].msg];
+		int fd;
+
+		if (moves[i].action == 'f') {
+			if (!folder || strcmp(folder, moves[i].folder)) {
+				if (folder_dst >= 0)
+					close(folder_dst);
+				folder = moves[i].folder;
+				snprintf(path, sizeof(path), "%s/Maildir/%s/cur", home, folder);
+				folder_dst = open(path, O_RDONLY | O_DIRECTORY);
+				if (folder_dst < 0)
+					syslog(LOG_WARNING, "%s: %m", path);
+			}
+			fd = folder_dst;
+		} else {
+			int d = moves[i].action == 'S' ? 0 : moves[i].action == 'I' ? 1 : 2;
+
+			if (dst[d] < 0) {
+				snprintf(path, sizeof(path), "%s/Maildir/%s/cur", home, subdirs[d]);
+				dst[d] = open(path, O_RDONLY | O_DIRECTORY);
+				if (dst[d] < 0)
+					syslog(LOG_WARNING, "%s: %m", path);
+			}
+			fd = dst[d];
+		}
+		if (fd < 0)
+			continue;
+
+		/* Already there */
+		if (fstat(fd, &sbuf) == 0 && sbuf.st_ino == src_ino[m->new])
+			continue;
+
+		/* Filed messages keep their flags, the rest are marked seen */
+		char new[PATH_SIZE], *p;
+		snprintf(new, sizeof(new) - 4, "%s", m->name);
+		if (moves[i].action == 'f') {
+			if (!strchr(new, ':'))
+				strcat(new, ":2,");
+		} else {
+			if ((p = strchr(new, ':')))
+				*p = 0;
+			strcat(new, ":2,S");
+		}
+
+		if (renameat(src[m->new], m->name, fd, new))
+			syslog(LOG_WARNING, "%s: %m", m->name);
+		else
+			__atomic_fetch_add(&batch->moved, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void batch_worker(const char *maildir, struct batch_msg *msgs, unsigned n)
+{
+	struct batch_move *moves = malloc(n * sizeof(struct batch_move));
+	unsigned i, n_moves = 0;
+
+	if (!moves)
+		exit(1);
+
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < n) {
+		char act = batch_one(maildir, &msgs[i]);
+
+		if (dry_run && act) {
+			char line[PATH_SIZE + 16];
+			int len = snprintf(line, sizeof(line), "%s/%s %c\n",
+							   msgs[i].new ? "new" : "cur", msgs[i].name, act);
+			/* one write so the workers do not mix up lines */
+			if (write(1, line, len) != len)
+				exit(1);
+		} else if (act == 'S' || act == 'I' || act == 'D' || act == 'f') {
+			moves[n_moves].msg = i;
+			moves[n_moves].action = act;
+			moves[n_moves].folder = folder_match;
+			++n_moves;
+		}
+
+		__atomic_fetch_add(&batch->done, 1, __ATOMIC_RELAXED);
+	}
+
+	batch_moves(maildir, msgs, moves, n_moves);
+	exit(0);
+}
+
+static void batch_progress(unsigned n, uint64_t start)
+{
+	double secs = (stats_clock() - start) / 1e9;
+
+	fprintf(stderr, "%u/%u messages %u moved %.0f/s\n", batch->done, n,
+			batch->moved, secs > 0 ? batch->done / secs : 0);
+}
+
+static int run_batch(const char *dir)
+{
+	struct batch_msg *msgs = NULL;
+	unsigned n = 0, max = 0;
+
+	char *maildir = realpath(dir, NULL);
+	if (!maildir) {
+		perror(dir);
+		return 1;
+	}
+
+	if (read_names(maildir, 0, &msgs, &n, &max) ||
+		read_names(maildir, 1, &msgs, &n, &max)) {
+		while (n > 0)
+			free(msgs[--n].name);
+		free(msgs);
+		free(maildir);
+		return 1;
+	}
+
+	batch = mmap(NULL, sizeof(*batch), PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (batch == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_workers < 1)
+		n_workers = 1;
+	else if (n_workers > MAX_WORKERS)
+		n_workers = MAX_WORKERS;
+
+	/* Same as file mode */
+	sender = "good-sender";
+
+	fflush(stdout);
+	uint64_t start = stats_clock();
+	int running = 0;
+	for (int i = 0; i < n_workers; ++i) {
+		pid_t pid = fork();
+		if (pid == 0)
+			batch_worker(maildir, msgs, n);
+		if (pid < 0)
+			perror("fork");
+		else
+			++running;
+	}
+
+	for (int ticks = 1; running > 0; ++ticks) {
+		while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+			--running;
+		if (running > 0) {
+			poll(NULL, 0, 100);
+			if (ticks % 10 == 0)
+				batch_progress(n, start);
+		}
+	}
+
+	batch_progress(n, start);
+	return 0;
+}
+
+#ifdef WANT_FORWARDING
+#include <sys/inotify.h>
+
+/* The spool name is the delivery name, with ,N after N failed tries */
+static int forward_tries(const char *name)
+{
+	const char *p = strrchr(name, ',');
+	return p ? strtol(p + 1, NULL, 10) : 0;
+}
+
+/* Returns 0 if sent */
+static int forward_one(CURL *curl, const char *path)
+{
+	struct user_data upload_ctx = { 0 };
+	struct stat sbuf;
+	char from[128];
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sbuf)) {
+		syslog(LOG_ERR, "%s: %m", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	upload_ctx.len = sbuf.st_size;
+	if (upload_ctx.len > 0) {
+		upload_ctx.base = mmap(NULL, upload_ctx.len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (upload_ctx.base == MAP_FAILED) {
+			syslog(LOG_ERR, "%s: %m", path);
+			close(fd);
+			return -1;
+		}
+		madvise((void *)upload_ctx.base, upload_ctx.len, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	/* The sender is in the Return-Path we added */
+	free(sender);
+	sender = NULL;
+	if (upload_ctx.len > 14 && strncmp(upload_ctx.base, "Return-Path: <", 14) == 0) {
+		const char *start = upload_ctx.base + 14;
+		const char *end = memchr(start, '>', upload_ctx.len - 14);
+		if (end)
+			sender = strndup(start, end - start);
+	}
+
+	upload_ctx.pos = skip_header(upload_ctx.base, upload_ctx.len);
+
+	snprintf(from, sizeof(from), "<%s>", sender ? sender : "");
+	curl_easy_setopt(curl, CURLOPT_MAIL_FROM, from);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_ctx);
+
+	CURLcode res = curl_easy_perform(curl);
+	if (upload_ctx.len > 0)
+		munmap((void *)upload_ctx.base, upload_ctx.len);
+	if (res != CURLE_OK) {
+		syslog(LOG_ERR, "forward %s: %s", path, curl_easy_strerror(res));
+		return -1;
+	}
+
+	if (sender)
+		forward_log();
+	return 0;
+}
+
+static void forward_failed(int dir, const char *name, int tries)
+{
+	char new[NAME_MAX + 1], *p;
+
+	if (++tries >= FWD_MAX_TRIES) {
+		syslog(LOG_ERR, "forward %s: giving up", name);
+		unlinkat(dir, name, 0);
+		return;
+	}
+
+	snprintf(new, sizeof(new) - 8, "%s", name);
+	if ((p = strrchr(new, ',')))
+		*p = 0;
+	sprintf(new + strlen(new), ",%d", tries);
+	if (renameat(dir, name, dir, new))
+		syslog(LOG_ERR, "%s: %m", name);
+	/* the mtime is the time of this try */
+	utimensat(dir, new, NULL, 0);
+}
+
+/* Sends what is due. Returns seconds until the next retry is due. */
+static int forward_scan(CURL *curl, const char *spool)
+{
+	char path[PATH_SIZE];
+	struct stat sbuf;
+	int wait = FWD_IDLE;
+
+	int dir = open(spool, O_RDONLY | O_DIRECTORY);
+	DIR *dp = dir >= 0 ? fdopendir(dir) : NULL;
+	if (!dp) {
+		syslog(LOG_ERR, "%s: %m", spool);
+		if (dir >= 0)
+			close(dir);
+		return wait;
+	}
+
+	time_t now = time(NULL);
+	struct dirent *ent;
+	while ((ent = readdir(dp))) {
+		if (*ent->d_name == '.')
+			continue;
+
+		int tries = forward_tries(ent->d_name);
+		if (tries) {
+			int delay = FWD_MIN_RETRY << (tries - 1);
+			if (delay > FWD_MAX_RETRY || delay <= 0)
+				delay = FWD_MAX_RETRY;
+			if (fstatat(dir, ent->d_name, &sbuf, 0))
+				continue;
+			if (sbuf.st_mtime + delay > now) {
+				if (sbuf.st_mtime + delay - now < wait)
+					wait = sbuf.st_mtime + delay - now;
+				continue;
+			}
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", spool, ent->d_name);
+		if (forward_one(curl, path) == 0)
+			unlinkat(dir, ent->d_name, 0);
+		else {
+			forward_failed(dir, ent->d_name, tries);
+			if (FWD_MIN_RETRY < wait)
+				wait = FWD_MIN_RETRY;
+		}
+	}
+
+	closedir(dp);
+	return wait;
+}
+
+static int run_forwarder(char *argv[])
+{
+	char spool[PATH_SIZE];
+	struct curl_slist *recipients = NULL;
+
+	snprintf(spool, sizeof(spool), "%s/%s", home, FWD_DIR);
+	if (mkdir(spool, 0700) && errno != EEXIST) {
+		perror(spool);
+		return 1;
+	}
+
+	CURL *curl = curl_easy_init();
+	if (!curl) {
+		syslog(LOG_ERR, "Unable to initialize curl");
+		return 1;
+	}
+	if (forward_setup(curl, &recipients))
+		return 1;
+
+	/* New messages are linked in */
+	struct pollfd pfd = { .events = POLLIN };
+	pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (pfd.fd < 0 || inotify_add_watch(pfd.fd, spool, IN_CREATE | IN_MOVED_TO) < 0) {
+		perror(spool);
+		return 1;
+	}
+
+	time_t mtime = config_mtime();
+
+	while (1) {
+		if (config_mtime() != mtime) {
+			execv("/proc/self/exe", argv);
+			syslog(LOG_ERR, "re-exec: %m");
+			mtime = config_mtime();
+		}
+
+		int wait = forward_scan(curl, spool);
+
+		if (poll(&pfd, 1, wait * 1000) > 0) {
+			uint8_t event[sizeof(struct inotify_event) + NAME_MAX + 1];
+			while (read(pfd.fd, event, sizeof(event)) > 0)
+				;
+		}
+	}
+}
+#endif
+
+static void usage(void)
+{
+	puts("usage:\trtf [-abcdfnCDQST] [-l logfile] [-F file] [-I wordlist] [-R maildir]\n"
+		 "where:\t-a   drop emails with app attachments\n"
+		 "\t-b   run bogofilter\n"
+		 "\t-c   add blacklist counts to logfile\n"
+		 "\t-d   mark emails not 'from me' as spam\n"
+		 "\t-f   forward emails\n"
+		 "\t-h   this help\n"
+		 "\t-n   dry run (mainly used with -F)\n"
+		 "\t-C   just check the config file\n"
+		 "\t     validates any regular expressions\n"
+		 "\t-D   run as a daemon for rtfc\n"
+		 "\t-S   dump the rule stats by cost\n"
+		 "\t-F   mainly for debugging rtf\n"
+		 "\t-I   import a bogoutil -d wordlist (- for stdin)\n"
+		 "\t-Q   run the forward queue\n"
+		 "\t-R   re-filter the messages in a Maildir\n"
+		 "\t-T   train bogofilter"
+		);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, rc, dump_stats = 0, daemon_mode = 0, forwarder = 0;
+	const char *wordlist = NULL, *batch_dir = NULL;
+	while ((c = getopt(argc, argv, OPTIONS)) != EOF)
+		switch (c) {
+		case 'h': usage(); exit(0);
+		case 'C': just_checking = 1; break;
+		case 'D': daemon_mode = 1; break;
+		case 'F': file_mode = optarg; break;
+		case 'I': wordlist = optarg; break;
+		case 'Q': forwarder = 1; break;
+		case 'R': batch_dir = optarg; break;
+		case 'S': dump_stats = 1; break;
+		default: delivery_option(c, optarg);
+		}
+
+	home = getenv("HOME");
+	if (!home) {
+		syslog(LOG_WARNING, "You are homeless!");
+		return 0; /* continue */
+	}
+
+	if (just_checking)
+		return read_config();
+
+	if (wordlist) {
+		FILE *fp = strcmp(wordlist, "-") ? fopen(wordlist, "r") : stdin;
+		if (!fp) {
+			perror(wordlist);
+			return 1;
+		}
+		return bayes_import(home, fp);
+	}
+	if (run_bogo)
+		use_bayes = bayes_open(home) == 0;
+
+	stats_open(home);
+	if (dump_stats) {
+		stats_dump();
+		return 0;
+	}
+	scan_stats = stats_rule("rtf", "matcher");
+
+	if (load_cache()) {
+		rc = read_config();
+		compile_lists();
+		if (rc == 0)
+			save_cache();
+	}
+
+	if (logfile)
+		eventlog_open(logfile);
+
+	if (daemon_mode)
+		return run_daemon(argv);
+
+	if (batch_dir)
+		return run_batch(batch_dir);
+
+	if (forwarder) {
+#ifdef WANT_FORWARDING
+		return run_forwarder(argv);
+#else
+		puts("Forwarding not enabled");
+		return 1;
+#endif
+	}
+
+	/* Groups only make sense with -D */
+	if (durability == DURABLE_GROUP)
+		durability = DURABLE_STRICT;
+
+	return deliver();
+}
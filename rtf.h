@@ -12,6 +12,7 @@
 #include <syslog.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
 #include <regex.h>
 #include <sys/file.h>
 #include <sys/stat.h>
@@ -39,6 +40,48 @@
 
 #define REGEXP_FLAGS (REG_EXTENDED | REG_ICASE | REG_NEWLINE)
 
+/* rtf -D and rtfc */
+#define RTF_SOCKET		".rtf.sock"
+#define RTF_MAX_ENV		(64 * 1024)
+
+// match.c
+struct matcher;
+typedef void (*match_fn)(unsigned id, void *arg);
+
+struct matcher *matcher_new(void);
+int matcher_add(struct matcher *m, const char *str, unsigned id);
+int matcher_compile(struct matcher *m);
+void matcher_scan(const struct matcher *m, const char *str, match_fn hit, void *arg);
+void matcher_free(struct matcher *m);
+long matcher_write(const struct matcher *m, FILE *fp);
+struct matcher *matcher_map(const void *buf, size_t len, unsigned n_ids);
+char *fast_strcasestr(const char *haystack, const char *needle);
+
+#define MAX_LITERALS		8
+#define MAX_LITERAL_LEN		64
+#define MIN_LITERAL_LEN		2
+int regex_literals(const char *re, char lits[MAX_LITERALS][MAX_LITERAL_LEN]);
+
+// stats.c
+struct rule_stats;
+
+int stats_open(const char *dir);
+struct rule_stats *stats_rule(const char *list, const char *rule);
+void stats_add(struct rule_stats *s, int hit, uint64_t nsec);
+uint64_t stats_clock(void);
+void stats_dump(void);
+
+// eventlog.c
+int eventlog_open(const char *fname);
+void eventlog_write(const char *rec, size_t len);
+
+// bayes.c
+int bayes_open(const char *dir);
+int bayes_classify(const char *fname);
+int bayes_register(const char *fname, int is_spam);
+int bayes_unregister(const char *fname, int is_spam);
+int bayes_import(const char *dir, FILE *fp);
+
 #ifdef IMAP
 /* imap-rtf only */
 
@@ -51,10 +94,25 @@
 struct entry {
 	const char *str;
 	const char *folder;
+	const char *match;	/* str without the field scope */
+	unsigned fields;	/* 0 for all fields */
+	int addr;			/* ADDR_EXACT and ADDR_DOMAIN are indexed */
+	struct rule_stats *stats;
+	unsigned hits;		/* for adaptive ordering */
 	int generation;
+	int list;
+	unsigned index;
+	unsigned rank;		/* position in the list, the first match wins */
 	struct entry *prev, *next;
 };
 
+/* The lists that are matched against header lines */
+enum { WHITELIST, GRAYLIST, BLACKLIST, FOLDERLIST, N_LISTS };
+
+/* The header fields that are matched against the lists */
+enum { FIELD_TO, FIELD_FROM, FIELD_SUBJECT, FIELD_LIST, FIELD_REPLY_TO,
+	   FIELD_RETURN_PATH, N_FIELDS };
+
 extern struct entry *global;
 extern struct entry *whitelist;
 extern struct entry *graylist;
@@ -74,26 +132,64 @@ int get_global_num(const char *glob);
 int read_config(void);
 void logmsg(int type, const char *fmt, ...);
 int add_entry(struct entry **head, char *str);
+void match_line(int field, const char *line, const struct entry **hits);
+void reorder_lists(void);
+unsigned rule_fields(void);
 
 void unobfuscate(const char *encoded);
 
+// addr.c
+enum { ADDR_NONE, ADDR_EXACT, ADDR_DOMAIN };
+struct addr_index;
+
+int addr_kind(const char *str);
+struct addr_index *addr_index_new(void);
+int addr_index_add(struct addr_index *ix, const char *str, unsigned id);
+int addr_index_bloom(struct addr_index *ix, double fp);
+void addr_index_free(struct addr_index *ix);
+void addr_scan(const struct addr_index *ix, const char *line, match_fn hit, void *arg);
+
 // bear.c
 int ssl_open(int sock, const char *host);
 int ssl_read(char *buffer, int len);
 int ssl_timed_read(char *buffer, int len, int timeout);
 int ssl_write(const char *buffer, int len);
+int ssl_queue(const char *buffer, int len);
+int ssl_flush(void);
 void ssl_close(void);
 int ssl_read_cert(const char *fname);
 
 // eyemap.c
 extern char reply[]; // BUFFER_SIZE
 extern int is_exchange;
+extern int has_move;
+extern int has_uidplus;
+extern size_t imap_bytes;
+
+struct response {
+	char *line, *end;	/* the whole response */
+	char *lit;			/* the last literal or NULL */
+	size_t lit_len;
+	char *code;			/* the response code without the [] */
+	size_t code_len;
+	unsigned tag;		/* tagged responses only */
+	int rc;
+};
+
+typedef void (*untagged_fn)(struct response *r, void *arg);
+typedef void (*done_fn)(int rc, void *arg);
+
+unsigned imap_queue(const char *want, untagged_fn untagged, done_fn done, void *arg,
+					const char *fmt, ...);
+int imap_wait(unsigned tag);
 
 int connect_to_server(const char *server, int port,
 					  const char *user, const char *passwd);
 int send_recv(const char *fmt, ...);
 int send_cmd(const char *cmd);
 int fetch(unsigned uid);
+unsigned fetch_queue(unsigned first, unsigned last, const char *item,
+					 void (*fn)(unsigned uid, size_t len));
 int fetchline(char *buf, int len);
 int check_folders(void);
 
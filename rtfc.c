@@ -0,0 +1,98 @@
+/* rtfc - thin client for rtf -D
+ *
+ * Use rtfc in place of rtf in your .qmail file. rtfc sends the
+ * environment, its arguments, and the message to the rtf daemon and
+ * exits with the daemon's exit code. The daemon delivers with rtfc's
+ * arguments, not its own. If the daemon is not running, rtfc just
+ * runs rtf with the same arguments.
+ */
+#include "rtf.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+
+static char buff[64 * 1024];
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void add_env(char *env, uint32_t *len, const char *name)
+{
+	const char *val = getenv(name);
+
+	if (val) {
+		int n = snprintf(env + *len, RTF_MAX_ENV - *len, "%s=%s", name, val);
+		if (n >= 0 && *len + n < RTF_MAX_ENV)
+			*len += n + 1;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *home = getenv("HOME");
+	int sock = -1;
+
+	if (home) {
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", home, RTF_SOCKET);
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+			close(sock);
+			sock = -1;
+		}
+	}
+
+	if (sock < 0) {
+		/* Nothing has been read yet, so rtf gets the whole message */
+		argv[0] = "rtf";
+		execvp("rtf", argv);
+		syslog(LOG_ERR, "rtf: %m");
+		return 0; /* continue */
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* length then the NAME=value strings */
+	static char env[RTF_MAX_ENV];
+	uint32_t len = 0;
+	add_env(env, &len, "SENDER");
+	add_env(env, &len, "DTLINE");
+	add_env(env, &len, "RPLINE");
+	for (int i = 1; i < argc; ++i) {
+		int n = snprintf(env + len, RTF_MAX_ENV - len, "ARG=%s", argv[i]);
+		if (n >= 0 && len + n < RTF_MAX_ENV)
+			len += n + 1;
+	}
+
+	if (write_all(sock, &len, sizeof(len)) || write_all(sock, env, len))
+		goto failed;
+
+	int n;
+	while ((n = read(0, buff, sizeof(buff))) > 0)
+		if (write_all(sock, buff, n))
+			goto failed;
+	if (n < 0 || shutdown(sock, SHUT_WR))
+		goto failed;
+
+	unsigned char code;
+	if (read(sock, &code, 1) != 1)
+		goto failed;
+
+	return code;
+
+failed:
+	syslog(LOG_ERR, "rtfc: lost the daemon");
+	return 0; /* continue */
+}
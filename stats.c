@@ -0,0 +1,178 @@
+/* Rule statistics
+ *
+ * Hit counts and match times for each rule are kept in ~/.rtf.stats,
+ * which is mapped shared so the counts add up across all the rtf
+ * processes and imap-rtf. Rules are found by a hash of the list name
+ * and the rule, so the counts survive config changes.
+ *
+ * A slot is claimed with a compare and swap on the key and the
+ * counters are only ever added to, so no locks are needed. The first
+ * byte of the name is stored last, so a name is complete once its
+ * first byte is set. A rule that finds no slot within MAX_PROBE of
+ * its hash is counted in the shared overflow slot.
+ */
+#include "rtf.h"
+#include <sys/mman.h>
+
+#define STATS_MAGIC		0x53465452 /* RTFS */
+#define STATS_SLOTS		8192
+#define STATS_NAME_LEN	96
+#define MAX_PROBE		64
+
+struct rule_stats {
+	uint64_t key; /* 0 for empty */
+	uint64_t hits;
+	uint64_t evals;
+	uint64_t nsec;
+	char name[STATS_NAME_LEN];
+};
+
+struct stats_file {
+	uint32_t magic;
+	uint32_t n_slots;
+	char pad[sizeof(struct rule_stats) - 8];
+	struct rule_stats slots[STATS_SLOTS];
+	struct rule_stats overflow;
+};
+
+static struct stats_file *stats;
+
+int stats_open(const char *dir)
+{
+	char fname[256];
+
+	if (stats)
+		return 0;
+
+	snprintf(fname, sizeof(fname), "%s/.rtf.stats", dir);
+	int fd = open(fname, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return -1;
+
+	/* Growing the file is safe to race, everybody sets the same size */
+	struct stat sbuf;
+	if (fstat(fd, &sbuf) ||
+		(sbuf.st_size < sizeof(struct stats_file) &&
+		 ftruncate(fd, sizeof(struct stats_file)))) {
+		close(fd);
+		return -1;
+	}
+
+	void *map = mmap(NULL, sizeof(struct stats_file), PROT_READ | PROT_WRITE,
+					 MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	stats = map;
+	if (stats->magic == 0) {
+		stats->n_slots = STATS_SLOTS;
+		__atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+	} else if (stats->magic != STATS_MAGIC || stats->n_slots != STATS_SLOTS) {
+		munmap(map, sizeof(struct stats_file));
+		stats = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns the stats for the rule or NULL if there are no stats */
+struct rule_stats *stats_rule(const char *list, const char *rule)
+{
+	if (!stats)
+		return NULL;
+
+	/* FNV-1a of list:rule */
+	uint64_t key = 0xcbf29ce484222325ULL;
+	const char *p;
+	for (p = list; *p; ++p)
+		key = (key ^ (uint8_t)*p) * 0x100000001b3ULL;
+	key = (key ^ ':') * 0x100000001b3ULL;
+	for (p = rule; *p; ++p)
+		key = (key ^ (uint8_t)*p) * 0x100000001b3ULL;
+	if (key == 0)
+		key = 1;
+
+	unsigned i = key & (STATS_SLOTS - 1);
+	for (int n = 0; n < MAX_PROBE; ++n, i = (i + 1) & (STATS_SLOTS - 1)) {
+		struct rule_stats *s = &stats->slots[i];
+		uint64_t old = 0;
+
+		if (__atomic_compare_exchange_n(&s->key, &old, key, 0,
+										__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			char name[STATS_NAME_LEN];
+			snprintf(name, sizeof(name), "%s:%s", list, rule);
+			memcpy(s->name + 1, name + 1, sizeof(name) - 1);
+			__atomic_store_n(&s->name[0], name[0], __ATOMIC_RELEASE);
+			return s;
+		}
+		if (old == key)
+			return s;
+	}
+
+	return &stats->overflow;
+}
+
+void stats_add(struct rule_stats *s, int hit, uint64_t nsec)
+{
+	if (s) {
+		__atomic_fetch_add(&s->evals, 1, __ATOMIC_RELAXED);
+		if (hit)
+			__atomic_fetch_add(&s->hits, 1, __ATOMIC_RELAXED);
+		if (nsec)
+			__atomic_fetch_add(&s->nsec, nsec, __ATOMIC_RELAXED);
+	}
+}
+
+uint64_t stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_cost(const void *a, const void *b)
+{
+	const struct rule_stats *s1 = *(const struct rule_stats **)a;
+	const struct rule_stats *s2 = *(const struct rule_stats **)b;
+
+	if (s1->nsec != s2->nsec)
+		return s1->nsec < s2->nsec ? 1 : -1;
+	if (s1->hits != s2->hits)
+		return s1->hits < s2->hits ? 1 : -1;
+	return strcmp(s1->name, s2->name);
+}
+
+/* Dump the rules sorted by cost */
+void stats_dump(void)
+{
+	static struct rule_stats *sorted[STATS_SLOTS];
+	int n = 0;
+
+	if (!stats) {
+		puts("No stats");
+		return;
+	}
+
+	/* Skip the slots still being claimed */
+	for (int i = 0; i < STATS_SLOTS; ++i)
+		if (__atomic_load_n(&stats->slots[i].name[0], __ATOMIC_ACQUIRE))
+			sorted[n++] = &stats->slots[i];
+
+	qsort(sorted, n, sizeof(struct rule_stats *), cmp_cost);
+
+	printf("%10s %10s %10s  %s\n", "ms", "hits", "evals", "rule");
+	for (int i = 0; i < n; ++i)
+		printf("%10.3f %10llu %10llu  %.*s\n",
+			   sorted[i]->nsec / 1000000.0,
+			   (unsigned long long)sorted[i]->hits,
+			   (unsigned long long)sorted[i]->evals,
+			   STATS_NAME_LEN, sorted[i]->name);
+	if (stats->overflow.evals)
+		printf("%10.3f %10llu %10llu  (overflow)\n",
+			   stats->overflow.nsec / 1000000.0,
+			   (unsigned long long)stats->overflow.hits,
+			   (unsigned long long)stats->overflow.evals);
+}
@@ -0,0 +1,73 @@
+/* Checks that every app_types entry is in the slot APP_HASH gives it.
+ * If not, it searches for new APP_HASH constants like the original
+ * search did.
+ */
+#define main rtf_main
+#include "../rtf.c"
+#undef main
+#include <assert.h>
+
+#define N_SLOTS (sizeof(app_types) / sizeof(app_types[0]))
+
+/* (len + s[a] + s[len / 2] * m) & 31 for a = 0..2 and m = 1..63 */
+static void search(void)
+{
+	for (int a = 0; a < 3; ++a)
+		for (int m = 1; m < 64; ++m) {
+			uint32_t used = 0;
+			int ok = 1;
+
+			for (int i = 0; i < N_SLOTS && ok; ++i) {
+				const char *s = app_types[i].name;
+				if (!s)
+					continue;
+				int len = strlen(s);
+				unsigned slot = (len + s[a] + s[len / 2] * m) & 31;
+				ok = !(used & (1u << slot));
+				used |= 1u << slot;
+			}
+
+			if (ok)
+				printf("s[%d] * %d works\n", a, m);
+		}
+}
+
+int main(int argc, char *argv[])
+{
+	int bad = 0;
+
+	for (int i = 0; i < N_SLOTS; ++i) {
+		const char *name = app_types[i].name;
+		if (!name)
+			continue;
+		if (APP_HASH(name, (int)strlen(name)) != i) {
+			printf("%s is in slot %d not %d\n", name, i,
+				   APP_HASH(name, (int)strlen(name)));
+			bad = 1;
+		}
+	}
+	if (bad)
+		search();
+	fflush(stdout);
+	assert(!bad);
+
+	/* And check_type() finds them */
+	char type[80];
+	drop_apps = 2;
+	for (int i = 0; i < N_SLOTS; ++i)
+		if (app_types[i].name) {
+			snprintf(type, sizeof(type), "application/%s; name=x", app_types[i].name);
+			assert(check_type(type));
+		}
+	assert(!check_type("application/pdf"));
+	assert(!check_type("text/plain"));
+
+	puts("Success!");
+	return 0;
+}
+
+/*
+ * Local Variables:
+ * compile-command: "gcc -g -Wall test_apps.c ../match.c ../stats.c ../bayes.c ../eventlog.c -lm -o test_apps"
+ * End:
+ */
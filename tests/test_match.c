@@ -0,0 +1,141 @@
+#include "../rtf.h"
+#include <assert.h>
+
+#define N_PATTERNS 200
+#define N_LINES 2000
+
+static char patterns[N_PATTERNS][8];
+static unsigned first;
+
+static void hit(unsigned id, void *arg)
+{
+	if (id < first)
+		first = id;
+}
+
+static void random_string(char *str, int len)
+{
+	/* small alphabet to get lots of overlapping matches */
+	static const char chars[] = "abcABC@.";
+
+	for (int i = 0; i < len; ++i)
+		str[i] = chars[rand() % (sizeof(chars) - 1)];
+	str[len] = 0;
+}
+
+static void check_literals(const char *re, const char *expect)
+{
+	char lits[MAX_LITERALS][MAX_LITERAL_LEN], str[256] = "";
+	int n = regex_literals(re, lits);
+
+	for (int i = 0; i < n; ++i) {
+		if (i) strcat(str, "|");
+		strcat(str, lits[i]);
+	}
+	if (strcmp(str, expect)) {
+		fprintf(stderr, "%s: got '%s' expected '%s'\n", re, str, expect);
+		assert(0);
+	}
+}
+
+static void test_literals(void)
+{
+	check_literals("viagra", "viagra");
+	check_literals("^From:.*@spam\\.com", "@spam.com");
+	check_literals("cheap.*pills?", "cheap");
+	check_literals("ab+cdef", "cdef");
+	check_literals("x(foo|barbaz)y", "foo|barbaz");
+	check_literals("(foo|barbaz)?yy", "yy");
+	check_literals("foo|bar", "foo|bar");
+	check_literals("foo|.*", "");
+	check_literals("[a-z]+@[[:alpha:]]+", "");
+	check_literals("a.b", "");
+	check_literals("\\wlong\\w", "long");
+	check_literals("foo)|bar", "");
+	check_literals("abc{0,2}de", "ab");
+	check_literals("abc{2}de", "abc");
+	check_literals("\\<viagra\\>", "viagra");
+	check_literals("\\`casino\\'", "casino");
+	check_literals("ab\\<cdef", "cdef");
+}
+
+/* Check the vector search against strcasestr at all the lengths and
+ * alignments that hit the vector loops and the tails.
+ */
+static void test_strcasestr(void)
+{
+	static const char chars[] = "aAbB@.zZ[{`";
+	char buf[160], needle[40];
+
+	for (int n = 0; n < 20000; ++n) {
+		int off = rand() % 16;
+		int hlen = rand() % (sizeof(buf) - 17);
+		int nlen = rand() % 8;
+		char *h = buf + off;
+
+		for (int i = 0; i < hlen; ++i)
+			h[i] = chars[rand() % (sizeof(chars) - 1)];
+		h[hlen] = 0;
+		for (int i = 0; i < nlen; ++i)
+			needle[i] = chars[rand() % (sizeof(chars) - 1)];
+		needle[nlen] = 0;
+
+		assert(fast_strcasestr(h, needle) == strcasestr(h, needle));
+	}
+
+	assert(fast_strcasestr("Microsoft Exchange", "microsoft exchange"));
+	assert(fast_strcasestr("[uidvalidity 42]", "[UIDVALIDITY") != NULL);
+	assert(fast_strcasestr("short", "longer needle") == NULL);
+}
+
+/* The first matching pattern must be the same one strcasestr finds */
+int main(int argc, char *argv[])
+{
+	test_literals();
+	test_strcasestr();
+
+	struct matcher *m = matcher_new();
+	assert(m);
+
+	srand(42);
+	for (int i = 0; i < N_PATTERNS; ++i) {
+		random_string(patterns[i], 1 + rand() % 6);
+		assert(matcher_add(m, patterns[i], i) == 0);
+	}
+	assert(matcher_compile(m) == 0);
+
+	for (int n = 0; n < N_LINES; ++n) {
+		char line[80];
+		random_string(line, rand() % 64);
+
+		unsigned expect = N_PATTERNS;
+		for (int i = 0; i < N_PATTERNS; ++i)
+			if (strcasestr(line, patterns[i])) {
+				expect = i;
+				break;
+			}
+
+		first = N_PATTERNS;
+		matcher_scan(m, line, hit, NULL);
+		assert(first == expect);
+	}
+
+	matcher_free(m);
+
+	/* An empty matcher never matches */
+	m = matcher_new();
+	assert(m && matcher_compile(m) == 0);
+	first = N_PATTERNS;
+	matcher_scan(m, "anything", hit, NULL);
+	assert(first == N_PATTERNS);
+	matcher_free(m);
+
+	puts("Success!");
+	return 0;
+}
+
+/*
+ * Local Variables:
+ * compile-command: "gcc -g -Wall test_match.c ../match.c -o test_match"
+ * End:
+ */